@@ -0,0 +1,234 @@
+#include "timer.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Measures the overhead of the library itself, in ns per operation and cache misses per operation.
+ * Usage: ./benchmark [operations per thread] [maximum number of threads]
+ * Build it with and without DISABLE_TIMER_THREADS / TIMER_THREAD_LOCAL_BUFFERS to compare the modes, see the Makefile.
+ */
+
+/*
+ * Counts the cache misses of this process and all threads it starts while the counter is enabled.
+ * If perf events are not available (e.g. in containers), the column shows "-".
+ */
+struct CacheMissCounter {
+	int fd = -1;
+
+	CacheMissCounter() {
+#ifdef __linux__
+		perf_event_attr attributes{};
+		attributes.type           = PERF_TYPE_HARDWARE;
+		attributes.size           = sizeof(attributes);
+		attributes.config         = PERF_COUNT_HW_CACHE_MISSES;
+		attributes.disabled       = 1;
+		attributes.inherit        = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv     = 1;
+		fd                        = int(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+	}
+
+	CacheMissCounter(const CacheMissCounter &) = delete;
+	void operator=(const CacheMissCounter &)   = delete;
+
+	~CacheMissCounter() {
+#ifdef __linux__
+		if (fd >= 0) { close(fd); }
+#endif
+	}
+
+	[[nodiscard]] bool available() const { return fd >= 0; }
+
+	void start() {
+#ifdef __linux__
+		if (fd < 0) { return; }
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	int64_t stop() {
+		int64_t count = 0;
+#ifdef __linux__
+		if (fd < 0) { return 0; }
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count)) { count = 0; }
+#endif
+		return count;
+	}
+};
+
+/*
+ * Output of the measured code goes to /dev/null, so the terminal does not dominate the results.
+ */
+struct SilencedOutput {
+	std::ofstream   null{"/dev/null"};
+	std::streambuf *original = std::cout.rdbuf(null.rdbuf());
+
+	SilencedOutput()                       = default;
+	SilencedOutput(const SilencedOutput &) = delete;
+	void operator=(const SilencedOutput &) = delete;
+	~SilencedOutput() { std::cout.rdbuf(original); }
+};
+
+void print_header() {
+	std::cout << std::left << std::setw(44) << "benchmark" << std::right << std::setw(8) << "threads" << std::setw(12)
+			  << "ns/op" << std::setw(16) << "misses/op" << "\n";
+}
+
+/*
+ * Runs body(operations) on the given number of threads at once and reports the time per operation of one thread.
+ */
+template<class FUNCTION>
+void run(const std::string &name, int threads, uint64_t operations, FUNCTION &&body) {
+	CacheMissCounter misses;
+	int64_t          elapsed;
+	int64_t          miss_count;
+	{
+		SilencedOutput silenced;
+		misses.start();
+		const int64_t start = get_time_ns();
+		if (threads == 1) {
+			body(operations);
+		} else {
+			std::vector<std::thread> workers;
+			for (int i = 0; i < threads; i++) { workers.emplace_back([&] { body(operations); }); }
+			for (auto &worker: workers) { worker.join(); }
+		}
+		elapsed    = get_time_ns() - start;
+		miss_count = misses.stop();
+	}
+
+	const double total_operations = double(operations) * threads;
+	std::cout << std::left << std::setw(44) << name << std::right << std::setw(8) << threads << std::setw(12)
+			  << std::fixed << std::setprecision(2) << double(elapsed) / double(operations) << std::setw(16);
+	if (misses.available()) {
+		std::cout << double(miss_count) / total_operations << "\n";
+	} else {
+		std::cout << "-" << "\n";
+	}
+}
+
+template<class CLOCK>
+void benchmark_clock(const std::string &name, uint64_t operations) {
+	run(name, 1, operations, [](uint64_t count) {
+		int64_t sum = 0;
+		for (uint64_t i = 0; i < count; i++) { sum += CLOCK::now(); }
+		volatile int64_t sink = sum;
+		(void) sink;
+	});
+}
+
+template<class NAME_TYPE>
+void benchmark_add(const std::string &name, NAME_TYPE event_name, uint64_t operations, int max_threads) {
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		Timer<NAME_TYPE> timer;
+		timer.initialize();
+		run(name, threads, operations, [&](uint64_t count) {
+			for (uint64_t i = 0; i < count; i++) { timer.add(event_name); }
+		});
+	}
+}
+
+/*
+ * The slowest single add() of a series, this is where reallocating the event list shows up.
+ */
+template<class STORAGE>
+void benchmark_worst_add(const std::string &name, uint64_t operations) {
+	Timer<int, TIMER_DEFAULT_CLOCK, STORAGE> timer;
+	timer.initialize();
+	int64_t worst = 0;
+	for (uint64_t i = 0; i < operations; i++) {
+		const int64_t start = get_time_ns();
+		timer.add(1);
+		worst = std::max(worst, get_time_ns() - start);
+	}
+	std::cout << std::left << std::setw(44) << name << std::right << std::setw(8) << 1 << std::setw(12) << std::fixed
+			  << std::setprecision(2) << double(worst) << std::setw(16) << "-" << "\n";
+}
+
+void section_function() { CODE_SECTION_TIMER; }
+
+void aggregated_section_function() { CODE_SECTION_TIMER_AGGREGATED; }
+
+void sampled_section_function() { CODE_SECTION_TIMER_SAMPLED(64); }
+
+int main(int argc, char **argv) {
+	const uint64_t operations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+	[[maybe_unused]] const int max_threads =
+			argc > 2 ? std::atoi(argv[2]) : int(std::max(1u, std::thread::hardware_concurrency()));
+
+	std::cout << "Timer benchmark, " << operations << " operations per thread";
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+	std::cout << ", TIMER_THREAD_LOCAL_BUFFERS";
+#elif defined(TIMER_THREADS)
+	std::cout << ", TIMER_THREADS";
+#else
+	std::cout << ", DISABLE_TIMER_THREADS";
+#endif
+	std::cout << "\n";
+	print_header();
+
+	benchmark_clock<SteadyClock>("get_time_ns", operations);
+	benchmark_clock<TscClock>("TscClock::now", operations);
+
+#ifdef TIMER_THREADS
+	const int thread_limit = max_threads;
+#else
+	const int thread_limit = 1; // without thread safety only one thread may use the library
+#endif
+	benchmark_add<int>("Timer<int>::add", 1, operations, thread_limit);
+	benchmark_add<const char *>("Timer<const char *>::add", "event", operations, thread_limit);
+	benchmark_add<std::string>("Timer<std::string>::add (short name)", "event", operations, thread_limit);
+	benchmark_add<std::string>("Timer<std::string>::add (long name)", "an event name longer than SSO", operations,
+							   thread_limit);
+	benchmark_add<EventName>("Timer<EventName>::add", "event", operations, thread_limit);
+	benchmark_worst_add<VectorStorage>("Timer<int>::add worst case (vector)", operations);
+	benchmark_worst_add<SegmentedStorage<>>("Timer<int>::add worst case (segmented)", operations);
+#ifdef __linux__
+	benchmark_worst_add<MappedFileStorage>("Timer<int>::add worst case (mapped)", operations);
+#endif
+#if __cplusplus >= 202002L
+	for (int threads = 1; threads <= thread_limit; threads *= 2) {
+		Timer<EventName> timer;
+		timer.initialize();
+		run("Timer<EventName>::add<\"event\">", threads, operations, [&](uint64_t count) {
+			for (uint64_t i = 0; i < count; i++) { timer.add<"event">(); }
+		});
+	}
+#endif
+
+	run("CodeSectionTimer (printing)", 1, operations / 10, [](uint64_t count) {
+		for (uint64_t i = 0; i < count; i++) { section_function(); }
+	});
+	for (int threads = 1; threads <= thread_limit; threads *= 2) {
+		run("CodeSectionTimer (aggregated)", threads, operations, [](uint64_t count) {
+			for (uint64_t i = 0; i < count; i++) { aggregated_section_function(); }
+		});
+	}
+	for (int threads = 1; threads <= thread_limit; threads *= 2) {
+		run("CodeSectionTimer (sampled 1 in 64)", threads, operations, [](uint64_t count) {
+			for (uint64_t i = 0; i < count; i++) { sampled_section_function(); }
+		});
+	}
+	CodeSectionRegistry::get().print_at_exit = false;
+
+	Timer<int> timer;
+	timer.initialize();
+	for (uint64_t i = 0; i < operations; i++) { timer.add(); }
+	run("Timer<int>::log (per event)", 1, operations, [&](uint64_t) { timer.log(); });
+}
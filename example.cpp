@@ -1,11 +1,28 @@
 #include "timer.h"
 
+#include <array>
 #include <chrono>
+#include <cstddef>
 #include <iostream>
+#include <memory_resource>
 #include <thread>
 
 void function() { CODE_SECTION_TIMER; }
 
+void hot_function() { CODE_SECTION_TIMER_AGGREGATED; }
+
+void budgeted_function(std::chrono::milliseconds work) { // only calls over 1.5ms are printed at exit
+	CODE_SECTION_TIMER_BUDGET(1.5ms);
+	std::this_thread::sleep_for(work);
+}
+
+#ifdef TIMER_SECTION_TREE
+void calling_function() {
+	CODE_SECTION_TIMER_AGGREGATED;
+	for (int i = 0; i < 10; i++) { hot_function(); }
+}
+#endif
+
 int main() {
 	std::cout << "Timer example:\n";
 	Timer<const char *> timer{};
@@ -17,24 +34,131 @@ int main() {
 	timer.add("third measurement");
 	timer.add("Last measurement");
 
+	auto &iterations = timer.loop("Loop");
+	for (int i = 0; i < 1000; i++) { iterations.next(); }
+
 	timer.log();
+	timer.log_histograms();
+
+	std::cout << "\nTrace export example (open example_trace.json in https://ui.perfetto.dev)\n";
+	{
+		TraceEventWriter writer("example_trace.json");
+		timer.export_trace(writer);
+	}
+
+	std::cout << "\nPreallocated timer example:\n";
+	std::array<std::byte, 4096>         arena{};
+	std::pmr::monotonic_buffer_resource resource(arena.data(), arena.size());
+	Timer<const char *, SteadyClock, PmrStorage> preallocated(&resource);
+	preallocated.initialize();
+	preallocated.reserve(16);
+	preallocated.add("Without allocation");
+	preallocated.log();
+
+	std::cout << "\nFlight recorder example (keeps the last 4 events):\n";
+	Timer<const char *, SteadyClock, RingStorage<4>> recorder{};
+	recorder.initialize();
+	for (const char *name: {"Step 1", "Step 2", "Step 3", "Step 4", "Step 5"}) { recorder.add(name); }
+	recorder.log();
+
+	std::cout << "\nSegmented storage example (add() never copies the events recorded so far):\n";
+	Timer<const char *, SteadyClock, SegmentedStorage<>> segmented{};
+	segmented.initialize();
+	segmented.reserve(10000); // allocates the chunks up front
+	for (int i = 0; i < 10000; i++) { segmented.add("Iteration"); }
+	segmented.log_histograms();
+
+#ifdef __linux__
+	std::cout << "\nMapped file example (./trace_dump example_events.log prints the file):\n";
+	{
+		Timer<const char *, SteadyClock, MappedFileStorage> mapped("example_events.log");
+		mapped.initialize();
+		mapped.add("Written to the file");
+		mapped.log();
+	}
+#endif
 
 	std::cout << "\nCode section example:\n";
 	function();
+
+	std::cout << "\nAggregated code section and budget example (printed at exit):\n";
+	for (int i = 0; i < 1000; i++) { hot_function(); }
+	budgeted_function(std::chrono::milliseconds(1));
+	budgeted_function(std::chrono::milliseconds(2));
+
+#ifdef TIMER_SECTION_TREE
+	std::cout << "\nCall tree example as folded stacks for flamegraph.pl (the tree is printed at exit):\n";
+	for (int i = 0; i < 100; i++) { calling_function(); }
+	CodeSectionRegistry::get().print_folded(std::cout);
+#endif
 }
 
 /*
     Example output:
     
 Timer example:
-Timer : First measurement after 1.00024s at 1.00024s
-Timer : Second measurement after 0.147825ms at 1.00039s
+Timer : First measurement after 1.00014s at 1.00014s
+Timer : Second measurement after 95.491µs at 1.00024s
+Timer :
+        First measurement after 1.00014s at 1.00014s
+        Second measurement after 95.491µs at 1.00024s
+        third measurement after 0.200122s at 1.20036s
+        Last measurement after 16.116µs at 1.20038s
+        loop Loop : 1000 iterations, total 47.751µs, mean 47ns, stddev 0.277µs, min 36ns, max 8.822µs, p50 39ns, p90 40ns, p99 42ns, p99.9 8.822µs
+Timer histograms :
+        First measurement : 1 times, p50 1.00014s, p90 1.00014s, p99 1.00014s, p99.9 1.00014s
+        Second measurement : 1 times, p50 95.491µs, p90 95.491µs, p99 95.491µs, p99.9 95.491µs
+        third measurement : 1 times, p50 0.200122s, p90 0.200122s, p99 0.200122s, p99.9 0.200122s
+        Last measurement : 1 times, p50 16.116µs, p90 16.116µs, p99 16.116µs, p99.9 16.116µs
+
+Trace export example (open example_trace.json in https://ui.perfetto.dev)
+
+Preallocated timer example:
+Timer :
+        Without allocation after 0.566µs at 0.566µs
+
+Flight recorder example (keeps the last 4 events):
 Timer :
-        First measurement after 1.00024s at 1.00024s
-        Second measurement after 0.147825ms at 1.00039s
-        third measurement after 0.200225s at 1.20061s
-        Last measurement after 5.23µs at 1.20062s
+        (2 older events overwritten)
+        Step 3 after 35ns at 35ns
+        Step 4 after 35ns at 70ns
+        Step 5 after 35ns at 0.105µs
+
+Segmented storage example (add() never copies the events recorded so far):
+Timer histograms :
+        Iteration : 10000 times, p50 34ns, p90 36ns, p99 49ns, p99.9 0.183µs
+
+Mapped file example (./trace_dump example_events.log prints the file):
+Timer :
+        Written to the file after 0.12µs at 0.12µs
 
 Code section example:
-Code section : void function() took 87ns 🠔 Note that the timing itself takes a lot of time
+Code section : void function() took 0.14µs 🠔 Note that the timing itself takes a lot of time
+
+Aggregated code section and budget example (printed at exit):
+Budget violations :
+        void budgeted_function(std::chrono::milliseconds):15 budget 1.5ms, 1 violations
+        void budgeted_function(std::chrono::milliseconds):15 took 2.07829ms at 1.07476ms in thread : 0
+Code sections :
+        void hot_function():12 called 1000 times, total 27.473µs, avg 27ns, min 26ns, max 41ns, p50 27ns, p90 28ns, p99 29ns, p99.9 41ns
+
+    With -DTIMER_SECTION_TREE every code section is aggregated and the output ends with:
+
+Call tree example as folded stacks for flamegraph.pl (the tree is printed at exit):
+void function() 41
+void hot_function() 32653
+void calling_function() 51070
+void calling_function();void hot_function() 27693
+Budget violations :
+        void budgeted_function(std::chrono::milliseconds):15 budget 1.5ms, 1 violations
+        void budgeted_function(std::chrono::milliseconds):15 took 2.06589ms at 1.07689ms in thread : 0
+Code sections :
+        void function():10 called 1 times, total 41ns, avg 41ns, min 41ns, max 41ns, p50 41ns, p90 41ns, p99 41ns, p99.9 41ns
+        void hot_function():12 called 2000 times, total 60.346µs, avg 30ns, min 25ns, max 0.192µs, p50 28ns, p90 37ns, p99 44ns, p99.9 0.187µs
+        void calling_function():21 called 100 times, total 78.763µs, avg 0.787µs, min 0.778µs, max 1.557µs, p50 0.783µs, p90 0.783µs, p99 0.815µs, p99.9 1.557µs
+Code section tree :
+        void function():10 called 1 times, inclusive 41ns, exclusive 41ns
+        void hot_function():12 called 1000 times, inclusive 32.653µs, exclusive 32.653µs
+        void calling_function():21 called 100 times, inclusive 78.763µs, exclusive 51.07µs
+                void hot_function():12 called 1000 times, inclusive 27.693µs, exclusive 27.693µs
 */
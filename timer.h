@@ -5,14 +5,34 @@
 #error "Use C++17 implementation"
 #endif
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <condition_variable>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
-#include <set>
+#include <new>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 /**
@@ -34,6 +54,36 @@
 #define TIMER_THREADS
 #endif
 
+/**
+ * Per thread event buffers using "#define TIMER_THREAD_LOCAL_BUFFERS".
+ * Every thread appends to its own cache line isolated buffer, so Timer::add() takes no lock.
+ * Timer::log() and Timer::print_current() merge the buffers by time stamp.
+ * Has no effect if thread safety is disabled.
+ */
+#if defined(TIMER_THREAD_LOCAL_BUFFERS) && !defined(TIMER_THREADS)
+#undef TIMER_THREAD_LOCAL_BUFFERS
+#endif
+
+/**
+ * Background output using "#define TIMER_ASYNC_OUTPUT".
+ * Timer::print_current() and the printing CodeSectionTimer only copy their measurement into a queue of the calling
+ * thread, a background thread formats and writes them, see AsyncOutput. Timer::log() still formats on the calling
+ * thread, but leaves the writing to the background thread as well.
+ * Has no effect if thread safety is disabled.
+ */
+#if defined(TIMER_ASYNC_OUTPUT) && !defined(TIMER_THREADS)
+#undef TIMER_ASYNC_OUTPUT
+#endif
+
+/**
+ * Call tree mode using "#define TIMER_SECTION_TREE", see CodeSectionNode.
+ * The tree is built from aggregated code sections, so it turns on TIMER_AGGREGATE_SECTIONS as well: nested
+ * CODE_SECTION_TIMER sections become nodes of the tree instead of printing a line per call.
+ */
+#if defined(TIMER_SECTION_TREE) && !defined(TIMER_AGGREGATE_SECTIONS)
+#define TIMER_AGGREGATE_SECTIONS
+#endif
+
 
 /**
  * Debug mode:
@@ -62,8 +112,8 @@ void print_stacktrace_and_exit() {
  * 		- check: checks if the state is as expected
  */
 struct DebugStateTracker {
-	bool initialized      = false;
-	int  number_of_events = 0;
+	bool             initialized      = false;
+	std::atomic<int> number_of_events = 0; // add() may run without a lock, see TIMER_THREAD_LOCAL_BUFFERS
 
 	/*
 	 * Check for initialization.
@@ -105,6 +155,22 @@ struct DebugStateTracker {
 			print_stacktrace_and_exit();
 		}
 	}
+
+	/*
+	 * Check that add() doesn't allocate, once the events were reserved. The flag is kept next to the storage it
+	 * describes, so it is dropped together with the storage (e.g. the per thread buffers on reset()).
+	 */
+
+	// state update function
+	void debug_reserve(bool &reserved) const { reserved = true; }
+
+	// state check function
+	void debug_check_no_allocation(bool reserved, bool allocates) const {
+		if (reserved && allocates) {
+			std::cerr << "add() allocated memory, more events were added than reserved" << std::endl;
+			print_stacktrace_and_exit();
+		}
+	}
 };
 
 #else
@@ -124,6 +190,12 @@ struct DebugStateTracker {
 
 	void debug_check_if_loggable() const { /* no-op */
 	}
+
+	void debug_reserve(bool &) const { /* no-op */
+	}
+
+	void debug_check_no_allocation(bool, bool) const { /* no-op */
+	}
 };
 #endif
 
@@ -135,7 +207,6 @@ struct DebugStateTracker {
 
 /*
  *TODO:
- *    - loop sections
  *    - printing formats
  *    - multithreaded flow graph
  */
@@ -146,230 +217,4237 @@ inline int64_t get_time_ns() {
 	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
-template<class NAME_TYPE = int>
-struct TimeStamp {
-	const NAME_TYPE name;
-	const int64_t   time_stamp = get_time_ns();
-#ifdef TIMER_THREADS
-	const std::thread::id thread_id;
-
-	explicit TimeStamp(NAME_TYPE id, std::thread::id thread_id) : name(id), thread_id(thread_id) {}
-	explicit TimeStamp(NAME_TYPE id) : name(id), thread_id(std::this_thread::get_id()) {}
-#else
-	explicit TimeStamp(NAME_TYPE id) : name(id) {}
+/**
+ * CPU time mode using "#define TIMER_CPU_TIME" (POSIX only, ignored elsewhere).
+ * Every time stamp also reads the CPU time of the calling thread. Timer::log(), Timer::print_current() and the code
+ * section timers then report the CPU time and the off-CPU time (wall time minus CPU time) next to the wall time.
+ * Code with a lot of off-CPU time waits for I/O, locks or the scheduler, code with little is compute bound.
+ */
+#if defined(TIMER_CPU_TIME) && !defined(__unix__) && !defined(__APPLE__)
+#undef TIMER_CPU_TIME
 #endif
 
-	static int64_t get_diff(TimeStamp first, TimeStamp last) { return last.time_stamp - first.time_stamp; }
+#ifdef TIMER_CPU_TIME
+#include <time.h>
 
+inline int64_t get_thread_cpu_time_ns() {
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return int64_t(time.tv_sec) * 1'000'000'000 + int64_t(time.tv_nsec);
+}
+#endif
 
-	static std::string to_string(int64_t time) {
-		const auto time_s                                     = double(time) / 1'000'000'000;
-		const auto time_ms                                    = double(time) / 1'000'000;
-		const auto time_MICRO_PLS_DO_NOT_USE_DEPRICATED_GCC_s = double(time) / 1'000;
-		const auto time_ns                                    = double(time);
+/**
+ * Clocks are passed as template argument to TimeStamp, Timer and CodeSectionTimer.
+ * A clock returns raw ticks from now() and converts a number of ticks to nanoseconds with to_ns().
+ * to_steady_ns() converts a time stamp to the time of the steady clock, so events of different clocks line up.
+ * Time stamps only store the raw ticks, they are converted when the results are reported.
+ */
+struct SteadyClock {
+	static int64_t now() { return get_time_ns(); }
 
-		/*
-		 * We map 0.1 ms - 100 ms to ms and 0.1µs - 100µs to µs. Anything higher is in s., lower is in ns.
-		 * Ubuntu uses an old version of GCC, used by CI, which does not support UTF-8. So we don't use μ.
-		 * This will change when we can upgrade the CI to something more recent.
-		 */
+	static int64_t to_ns(int64_t ticks) { return ticks; }
 
-		std::ostringstream result;
-		if (time >= 100'000'000) {
-			result << time_s << 's';
-		} else if (time >= 100'000) {
-			result << time_ms << "ms";
-		} else if (time >= 100) {
-			result << time_MICRO_PLS_DO_NOT_USE_DEPRICATED_GCC_s << "µs";
-		} else {
-			result << time_ns << "ns";
-		}
-		return result.str();
+	static int64_t to_steady_ns(int64_t ticks) { return ticks; }
+
+	static void calibrate() { /* no-op */
 	}
 };
 
-struct CodeSectionTimer {
-	using TimeStampType = TimeStamp<const char *>;
-	const TimeStampType start;
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
 
-	explicit CodeSectionTimer(const char *name) : start(name) {}
-	CodeSectionTimer(CodeSectionTimer &)  = delete;
-	CodeSectionTimer(CodeSectionTimer &&) = delete;
-	void operator=(CodeSectionTimer &)    = delete;
+/**
+ * Reads the time stamp counter of the CPU with rdtscp, which is a lot cheaper than a system call or even the vDSO.
+ * The tick rate is calibrated against the steady clock (CLOCK_MONOTONIC on Linux) when it is first needed.
+ * Call TscClock::calibrate() at startup, if the calibration (~10ms) should not happen while measuring.
+ * Only use it on CPUs with an invariant TSC, a warning is printed otherwise.
+ */
+struct TscClock {
+	struct Calibration {
+		double  ns_per_tick  = 1.0;
+		bool    invariant    = false;
+		int64_t anchor_ns    = 0; // a steady clock time and the tick count at the same time
+		int64_t anchor_ticks = 0;
+	};
 
-	~CodeSectionTimer() {
-		const TimeStampType end("");
+	static int64_t now() {
+		unsigned int processor;
+		return int64_t(__rdtscp(&processor));
+	}
+
+	static int64_t to_ns(int64_t ticks) { return int64_t(double(ticks) * calibration().ns_per_tick); }
+
+	static int64_t to_steady_ns(int64_t ticks) {
+		const Calibration &current = calibration();
+		return current.anchor_ns + int64_t(double(ticks - current.anchor_ticks) * current.ns_per_tick);
+	}
+
+	static void calibrate() { (void) calibration(); }
+
+	static const Calibration &calibration() {
+		static const Calibration result = measure();
+		return result;
+	}
+
+	/*
+	 * CPUID leaf 0x80000007, EDX bit 8 reports a TSC which runs at a constant rate in all power states.
+	 */
+	static bool has_invariant_tsc() {
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) { return false; }
+		return (edx & (1u << 8)) != 0;
+	}
+
+	/*
+	 * Each clock read is bracketed by two counter reads, so the pairs stay accurate even if we get preempted.
+	 */
+	static Calibration measure() {
+		constexpr int64_t calibration_time_ns = 10'000'000;
+
+		const auto read_pair = [](int64_t &ns, int64_t &ticks) {
+			const int64_t before = now();
+			ns                   = get_time_ns();
+			const int64_t after  = now();
+			ticks                = before + (after - before) / 2;
+		};
 
-		std::cout << "Code section : " << start.name << " took "
-				  << TimeStampType::to_string(TimeStampType::get_diff(start, end)) << std::endl;
+		int64_t start_ns, start_ticks, end_ns, end_ticks;
+		read_pair(start_ns, start_ticks);
+		do {
+			read_pair(end_ns, end_ticks);
+		} while (end_ns - start_ns < calibration_time_ns);
+
+		Calibration result;
+		result.ns_per_tick  = double(end_ns - start_ns) / double(end_ticks - start_ticks);
+		result.invariant    = has_invariant_tsc();
+		result.anchor_ns    = end_ns;
+		result.anchor_ticks = end_ticks;
+		if (!result.invariant) {
+			std::cerr << "TscClock: the CPU does not report an invariant TSC, measurements may be wrong" << std::endl;
+		}
+		return result;
 	}
 };
+#else
+/*
+ * No time stamp counter, fall back to the steady clock.
+ */
+using TscClock = SteadyClock;
+#endif
 
-#define CODE_SECTION_TIMER_CONCATENATE(A, B) A##B
-#define CODE_SECTION_TIMER_CONCATENATE2(A, B) CODE_SECTION_TIMER_CONCATENATE(A, B)
 /**
- * @brief Prints the time passed between the start and the end of the code section.
+ * The clock used if none is passed as template argument. Change it with "#define TIMER_DEFAULT_CLOCK TscClock".
  */
-#define CODE_SECTION_TIMER                                                                                             \
-	const auto CODE_SECTION_TIMER_CONCATENATE2(code_section_timer_internal_do_not_touch, __LINE__) =                   \
-			CodeSectionTimer(__PRETTY_FUNCTION__)
+#ifndef TIMER_DEFAULT_CLOCK
+#define TIMER_DEFAULT_CLOCK SteadyClock
+#endif
 
 /**
- * Timer class holds information on a measurement series, consisting of a number of events.
- * The measurements can then be logged to the console.
- * @tparam NAME_TYPE The type of the name of the event. Events are named using the NAME_TYPE type.
- * It can be one of int, std::string, const char*. Other types should work as well, but are not tested.
-*/
-template<class NAME_TYPE = int>
-struct Timer : protected DebugStateTracker {
-	using TIME_STAMP_TYPE = TimeStamp<NAME_TYPE>;
-	std::vector<TIME_STAMP_TYPE> time_stamps{};
+ * Buffer size needed by format_duration().
+ */
+constexpr std::size_t max_duration_length = 24;
 
-	// IDs for automatic naming
-	int id = 0;
+/**
+ * Formats a duration in nanoseconds with six significant digits and a unit, e.g. "1.00024s".
+ * Writes into a caller provided buffer of at least max_duration_length characters and returns the end of the text.
+ * Nothing is allocated, see TimeStamp::to_string() for the std::string version.
+ */
+inline char *format_duration(char *first, int64_t time) {
+	/*
+	 * We map 0.1 ms - 100 ms to ms and 0.1µs - 100µs to µs. Anything higher is in s., lower is in ns.
+	 * Ubuntu uses an old version of GCC, used by CI, which does not support UTF-8. So we don't use μ.
+	 * This will change when we can upgrade the CI to something more recent.
+	 */
+	double           value;
+	std::string_view unit;
+	if (time >= 100'000'000) {
+		value = double(time) / 1'000'000'000;
+		unit  = "s";
+	} else if (time >= 100'000) {
+		value = double(time) / 1'000'000;
+		unit  = "ms";
+	} else if (time >= 100) {
+		value = double(time) / 1'000;
+		unit  = "µs";
+	} else {
+		value = double(time);
+		unit  = "ns";
+	}
 
-#ifdef TIMER_THREADS
-	std::set<std::thread::id> thread_ids{};
-	std::mutex                multithreading_guard{};
-#endif
+	char *last = std::to_chars(first, first + max_duration_length - unit.size(), value, std::chars_format::general, 6).ptr;
+	return std::copy(unit.begin(), unit.end(), last);
+}
+
+/**
+ * Receives the formatted output in batches, see OutputBuffer. The code section timers, Timer::print_current() and
+ * Timer::log() write to output_sink(), stdout by default. write() may be called by several threads at once.
+ */
+struct Sink {
+	Sink()                       = default;
+	Sink(const Sink &)           = delete;
+	void operator=(const Sink &) = delete;
+	virtual ~Sink()              = default;
+
+	virtual void write(std::string_view batch) = 0;
 
 	/**
-	 * @brief Resets the timer.
-	 *
-	 * After calling this function, the timer can be initialized used again. Calling initialize on a timer automatically resets it.
-	 * Therefor there is no need to call this function before calling initialize.
+	 * Writes what the sink still holds back.
 	 */
-	void reset() {
-		debug_reset();
-		time_stamps.clear();
-		id = 0;
-#ifdef TIMER_THREADS
-		thread_ids.clear();
-#endif
+	virtual void flush() { /* nothing held back */
 	}
+};
 
-	/**
-	 * Initialize reference point from where the measurements start. Call only once, if you don't want to reset the timer.
-	 */
-	void initialize() {
-		if (!time_stamps.empty()) { reset(); }
-		debug_init();
-		add();
+struct StreamSink : Sink {
+	std::ostream &stream;
+
+	explicit StreamSink(std::ostream &stream) : stream(stream) {}
+
+	void write(std::string_view batch) override { stream.write(batch.data(), std::streamsize(batch.size())); }
+
+	void flush() override { stream.flush(); }
+};
+
+/**
+ * Writes to std::cout, so redirecting std::cout still works, and flushes every batch.
+ */
+struct StdoutSink : StreamSink {
+	StdoutSink() : StreamSink(std::cout) {}
+
+	void write(std::string_view batch) override {
+		StreamSink::write(batch);
+		stream.flush();
 	}
+};
 
-	void add_thread_unsafe(NAME_TYPE name) {
-		debug_check_if_initialized();
-		debug_add_event();
-#ifdef TIMER_THREADS
-		const auto thread_id = std::this_thread::get_id();
-		thread_ids.insert(thread_id);
-		time_stamps.emplace_back(name, thread_id);
-#else
-		time_stamps.emplace_back(name);
-#endif
+/**
+ * Collects the output in memory, e.g. for tests or to attach it to a report.
+ */
+struct MemorySink : Sink {
+	std::string text{};
+	std::mutex  guard{};
+
+	void write(std::string_view batch) override {
+		std::lock_guard lock(guard);
+		text.append(batch);
 	}
 
-	/**
-	 * Add a named event. Must be called after initialize.
-	 */
-	const Timer &add(NAME_TYPE name) {
-#ifdef TIMER_THREADS
-		std::lock_guard lock(multithreading_guard);
-#endif
-		add_thread_unsafe(name);
-		return *this;
+	[[nodiscard]] std::string contents() {
+		std::lock_guard lock(guard);
+		return text;
+	}
+};
+
+/**
+ * Hands every batch to a function, which has to be thread safe itself.
+ */
+struct CallbackSink : Sink {
+	std::function<void(std::string_view)> callback;
+
+	explicit CallbackSink(std::function<void(std::string_view)> callback) : callback(std::move(callback)) {}
+
+	void write(std::string_view batch) override { callback(batch); }
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Appends to a file opened with O_APPEND, or truncates it first if append is false. Small batches are collected in a
+ * page sized buffer, so a line does not cost a system call. A batch which does not fit is written together with the
+ * buffer in a single writev(). Call flush() to write the buffer, the destructor does as well.
+ */
+struct FileSink : Sink {
+	static constexpr std::size_t page_size = 4096;
+
+	int         fd   = -1;
+	std::size_t used = 0;
+	char        page[page_size]{};
+	std::mutex  guard{};
+
+	explicit FileSink(const char *path, bool append = true)
+		: fd(open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644)) {
+		if (fd < 0) { std::cerr << "FileSink: can not open " << path << std::endl; }
+	}
+
+	~FileSink() override {
+		flush();
+		if (fd >= 0) { ::close(fd); }
+	}
+
+	[[nodiscard]] bool is_open() const { return fd >= 0; }
+
+	void write(std::string_view batch) override {
+		std::lock_guard lock(guard);
+		if (page_size - used >= batch.size()) {
+			std::memcpy(page + used, batch.data(), batch.size());
+			used += batch.size();
+			if (used == page_size) { write_page({}); }
+			return;
+		}
+		write_page(batch);
+	}
+
+	void flush() override {
+		std::lock_guard lock(guard);
+		write_page({});
 	}
 
+private:
 	/*
-	 * Note this naming scheme for each thread is not at all guaranteed to be equal to other names.
-	 * We name all threads which ever called add() from 0 to n-1.
+	 * Writes the buffered page followed by batch, retrying partial writes.
 	 */
-	[[nodiscard]] int get_thread_name([[maybe_unused]] const std::thread::id &id_) const {
-#ifdef TIMER_THREADS
-		int i = 0;
-		for (auto &thread_id: thread_ids) {
-			if (thread_id == id_) { return i; }
-			i++;
+	void write_page(std::string_view batch) {
+		iovec parts[2] = {{page, used}, {const_cast<char *>(batch.data()), batch.size()}};
+		int   first    = 0;
+		used           = 0;
+		while (fd >= 0 && first < 2) {
+			if (parts[first].iov_len == 0) {
+				first++;
+				continue;
+			}
+			const ssize_t written = writev(fd, parts + first, 2 - first);
+			if (written < 0) {
+				if (errno == EINTR) { continue; }
+				std::cerr << "FileSink: write failed" << std::endl;
+				return;
+			}
+			auto remaining = std::size_t(written);
+			for (; first < 2 && remaining >= parts[first].iov_len; first++) { remaining -= parts[first].iov_len; }
+			if (first < 2) {
+				parts[first].iov_base = static_cast<char *>(parts[first].iov_base) + remaining;
+				parts[first].iov_len -= remaining;
+			}
 		}
-		return -1;
+	}
+};
 #else
-		return 0;
-#endif
+/**
+ * Writes to a file through std::ofstream, where the POSIX FileSink is not available.
+ */
+struct FileSink : Sink {
+	std::ofstream file;
+	std::mutex    guard{};
+
+	explicit FileSink(const char *path, bool append = true)
+		: file(path, std::ios::binary | (append ? std::ios::app : std::ios::trunc)) {
+		if (!file) { std::cerr << "FileSink: can not open " << path << std::endl; }
 	}
 
-	[[nodiscard]] bool has_threads() const {
-#ifdef TIMER_THREADS
-		return thread_ids.size() > 1;
-#else
-		return false;
-#endif
+	[[nodiscard]] bool is_open() const { return file.is_open(); }
+
+	void write(std::string_view batch) override {
+		std::lock_guard lock(guard);
+		file.write(batch.data(), std::streamsize(batch.size()));
 	}
 
-	static constexpr const char *integer_string_literal_helper(int i) {
-		const char *ints[] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
-		if (i < 10) return ints[i];
-		return "";
+	void flush() override {
+		std::lock_guard lock(guard);
+		file.flush();
+	}
+};
+#endif
+
+/**
+ * The sink the code section timers, Timer::print_current(), Timer::log() and the reports of the registries write to.
+ * Change it with output_sink().store(&sink). The sink has to outlive all output, with TIMER_ASYNC_OUTPUT call
+ * AsyncOutput::get().flush() before destroying it.
+ */
+inline std::atomic<Sink *> &output_sink() {
+	static StdoutSink         *standard_output = new StdoutSink(); // never destroyed, output works until the very end
+	static std::atomic<Sink *> sink{standard_output};
+	return sink;
+}
+
+/*
+ * Writes a report formatted with operator<< to output_sink() in one batch. Defined after AsyncOutput.
+ */
+template<class PRINT>
+void print_to_output_sink(PRINT print);
+
+/**
+ * Collects formatted output in a fixed size buffer and hands it to the sink or stream in large writes.
+ * The rest is written when the buffer is destroyed or flushed.
+ */
+template<std::size_t CAPACITY = (1 << 16)>
+struct OutputBuffer {
+	std::optional<StreamSink> stream_sink; // only used for output to a std::ostream
+	Sink                     *output;
+	std::size_t               used = 0;
+	char                      data[CAPACITY]; // only the first used characters are initialized
+
+	explicit OutputBuffer(std::ostream &stream) : stream_sink(std::in_place, stream), output(&*stream_sink) {}
+	explicit OutputBuffer(Sink &sink) : output(&sink) {}
+	OutputBuffer(const OutputBuffer &)   = delete;
+	void operator=(const OutputBuffer &) = delete;
+	~OutputBuffer() { flush(); }
+
+	void flush() {
+		if (used != 0) { output->write(std::string_view(data, used)); }
+		used = 0;
 	}
 
-	/**
-	 * Add an unnamed event. Must be called after initialize.
+	/*
+	 * Makes room for at least length characters and returns where to write them. Finish with commit().
 	 */
-	const Timer &add() {
-		if constexpr (std::is_convertible<int, NAME_TYPE>::value) {
-			add(id++);
-		} else if constexpr (std::is_same<NAME_TYPE, std::string>::value) {
-			add(std::to_string(id));
-			++id;
-		} else if constexpr (std::is_same<NAME_TYPE, const char *>::value) {
-			add(integer_string_literal_helper(id));
-			++id;
-		} else {
-			add({});
+	char *reserve(std::size_t length) {
+		if (CAPACITY - used < length) { flush(); }
+		return data + used;
+	}
+
+	void commit(char *last) { used = std::size_t(last - data); }
+
+	void append(std::string_view text) {
+		if (CAPACITY - used < text.size()) {
+			flush();
+			if (text.size() > CAPACITY) {
+				output->write(text);
+				return;
+			}
 		}
-		return *this;
+		std::memcpy(data + used, text.data(), text.size());
+		used += text.size();
 	}
 
-	[[nodiscard]] int64_t get_time_since_init(uint64_t index) const {
-		return TIME_STAMP_TYPE::get_diff(time_stamps[0], time_stamps[index]);
+	void append(char c) { append(std::string_view(&c, 1)); }
+
+	void append_integer(int64_t value) {
+		char *first = reserve(20);
+		commit(std::to_chars(first, first + 20, value).ptr);
 	}
 
-	[[nodiscard]] int64_t get_time_since_last(uint64_t index) const {
-		return TIME_STAMP_TYPE::get_diff(time_stamps[index - 1], time_stamps[index]);
+	void append_duration(int64_t time) {
+		char *first = reserve(max_duration_length);
+		commit(format_duration(first, time));
 	}
 
-	[[nodiscard]] std::string thread_output_formatter([[maybe_unused]] const TIME_STAMP_TYPE &time_stamp) const {
-		if (!has_threads()) { return ""; }
-		static std::string result;
-#ifdef TIMER_THREADS
-		result = " in thread : " + std::to_string(get_thread_name(time_stamp.thread_id));
-#endif
-		return result;
+	void append_number(double value, int significant_digits = 3) {
+		char *first = reserve(32);
+		commit(std::to_chars(first, first + 32, value, std::chars_format::general, significant_digits).ptr);
 	}
 
-	/**
-	 * Print information about the last measurement.
-	 */
-	void print_current() const {
-		debug_check_if_loggable();
-		const uint64_t index = time_stamps.size() - 1;
-		std::cout << "Timer : " << time_stamps[index].name << " after "
-				  << TIME_STAMP_TYPE::to_string(get_time_since_last(index)) << " at "
-				  << TIME_STAMP_TYPE::to_string(get_time_since_init(index))
-				  << thread_output_formatter(time_stamps[index]) << "\n";
+	void append_cpu_time(int64_t wall_time, int64_t cpu_time) {
+		append(", CPU ");
+		append_duration(cpu_time);
+		append(", off-CPU ");
+		append_duration(std::max(int64_t(0), wall_time - cpu_time));
 	}
 
-	/**
-	 * Log all measurements
-	 */
-	void log() const {
-		const uint64_t length = time_stamps.size();
-		std::cout << "Timer :\n";
-		for (uint64_t i = 1; i < length; i++) {
-			const auto time_since_last = TIME_STAMP_TYPE::to_string(get_time_since_last(i));
-			const auto time_since_init = TIME_STAMP_TYPE::to_string(get_time_since_init(i));
-			std::cout << "\t" << time_stamps[i].name << " after " << time_since_last << " at " << time_since_init
-					  << thread_output_formatter(time_stamps[i]) << "\n";
+	template<class NAME_TYPE>
+	void append_name(const NAME_TYPE &name) {
+		if constexpr (std::is_same_v<NAME_TYPE, const char *>) {
+			append(std::string_view(name == nullptr ? "" : name));
+		} else if constexpr (std::is_convertible_v<const NAME_TYPE &, std::string_view>) {
+			append(std::string_view(name));
+		} else if constexpr (std::is_integral_v<NAME_TYPE>) {
+			append_integer(int64_t(name));
+		} else {
+			std::ostringstream text;
+			text << name;
+			append(text.str());
+		}
+	}
+};
+
+#ifdef TIMER_THREADS
+/*
+ * Hands out the thread indices. An index goes back to the free list when its thread exits, so a thread pool which
+ * keeps replacing its threads never runs out of indices, and two live threads never share one.
+ * The generation counts how often an index was handed out, so events of the threads sharing an index can be told apart.
+ */
+struct ThreadIndexAllocator {
+	struct Lease {
+		uint16_t index;
+		uint16_t generation;
+	};
+
+	std::mutex            guard{};
+	std::vector<uint16_t> free_indices{};
+	std::vector<uint16_t> generations{}; // by index
+	uint32_t              next_index = 0;
+
+	static ThreadIndexAllocator &get() {
+		static ThreadIndexAllocator allocator;
+		return allocator;
+	}
+
+	Lease acquire() {
+		std::lock_guard lock(guard);
+		if (!free_indices.empty()) {
+			const uint16_t index = free_indices.back();
+			free_indices.pop_back();
+			return {index, ++generations[index]};
+		}
+		if (next_index > std::numeric_limits<uint16_t>::max()) {
+			std::cerr << "get_thread_index(): more than 65536 threads use the timer at the same time" << std::endl;
+			std::terminate();
 		}
+		generations.push_back(0);
+		return {uint16_t(next_index++), 0};
+	}
+
+	void release(uint16_t index) {
+		std::lock_guard lock(guard);
+		free_indices.push_back(index);
 	}
 };
 #endif
+
+#ifdef TIMER_THREADS
+/*
+ * The thread index of the calling thread, given back when the thread exits.
+ */
+inline const ThreadIndexAllocator::Lease &this_thread_lease() {
+	struct Owner {
+		const ThreadIndexAllocator::Lease lease = ThreadIndexAllocator::get().acquire();
+		~Owner() { ThreadIndexAllocator::get().release(lease.index); }
+	};
+	thread_local const Owner owner;
+	return owner.lease;
+}
+#endif
+
+/**
+ * Every thread which uses the library gets a small number, counting from 0 in the order of first use.
+ * Looking it up is a thread local read, unlike std::thread::id it is cheap to store, compare and print.
+ * The number of a thread which exited is reused by a later thread, so their events share a thread name.
+ * CPU time and performance counters of the later thread are not compared with the readings of the earlier one.
+ */
+inline uint16_t get_thread_index() {
+#ifdef TIMER_THREADS
+	return this_thread_lease().index;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Hardware performance counters using "#define TIMER_PERF_COUNTERS" (Linux only, ignored elsewhere).
+ * Every thread opens a perf_event_open group of cycles, instructions, last level cache misses and branch misses.
+ * If the hardware counters are not available (e.g. in virtual machines or containers), software counters are
+ * used instead: context switches, CPU migrations, page faults and major page faults.
+ * The counters are read with every time stamp. Timer::log() and CodeSectionTimer print the difference to the previous
+ * event of the same thread, the aggregated code sections print the average per call.
+ * Where the kernel allows it (/sys/bus/event_source/devices/cpu/rdpmc), the counters are read with rdpmc through the
+ * mapped page of each event, which costs tens of cycles instead of a system call.
+ */
+#if defined(TIMER_PERF_COUNTERS) && !defined(__linux__)
+#undef TIMER_PERF_COUNTERS
+#endif
+
+#ifdef TIMER_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct PerfCounters {
+	static constexpr int count = 4;
+	using Values               = std::array<int64_t, count>;
+
+	enum class Mode { unavailable, hardware, software };
+
+	struct Event {
+		uint32_t    type;
+		uint64_t    config;
+		const char *name;
+	};
+
+	static constexpr Event hardware_events[count] = {
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses"},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+	};
+	static constexpr Event software_events[count] = {
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context switches"},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "CPU migrations"},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page faults"},
+			{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, "major page faults"},
+	};
+
+	/*
+	 * The counters of one thread. Only the thread which opened them may read them.
+	 */
+	struct Group {
+		int                   fds[count]   = {-1, -1, -1, -1};
+		perf_event_mmap_page *pages[count] = {};
+		bool                  opened       = false;
+
+		explicit Group(Mode mode) {
+			if (mode == Mode::unavailable) { return; }
+			const Event *events = mode == Mode::hardware ? hardware_events : software_events;
+			for (int i = 0; i < count; i++) {
+				fds[i] = open_event(events[i], i == 0 ? -1 : fds[0]);
+				if (fds[i] < 0) { return; }
+				void *page = mmap(nullptr, std::size_t(sysconf(_SC_PAGESIZE)), PROT_READ, MAP_SHARED, fds[i], 0);
+				if (page != MAP_FAILED) { pages[i] = static_cast<perf_event_mmap_page *>(page); }
+			}
+			opened = true;
+		}
+		Group(const Group &)          = delete;
+		void operator=(const Group &) = delete;
+
+		~Group() {
+			for (int i = 0; i < count; i++) {
+				if (pages[i] != nullptr) { munmap(pages[i], std::size_t(sysconf(_SC_PAGESIZE))); }
+				if (fds[i] >= 0) { close(fds[i]); }
+			}
+		}
+
+		[[nodiscard]] Values read() const {
+			Values values{};
+			if (!opened) { return values; }
+			bool mapped = true;
+			for (int i = 0; i < count && mapped; i++) { mapped = read_mapped(pages[i], values[i]); }
+			if (!mapped) { read_group(values); }
+			return values;
+		}
+
+		/*
+		 * One system call for the whole group, used for software events and if rdpmc is not allowed.
+		 */
+		void read_group(Values &values) const {
+			uint64_t data[1 + count] = {}; // PERF_FORMAT_GROUP: number of events, then their values
+			if (::read(fds[0], data, sizeof(data)) != ssize_t(sizeof(data))) { return; }
+			for (int i = 0; i < count; i++) { values[std::size_t(i)] = int64_t(data[1 + i]); }
+		}
+	};
+
+	/*
+	 * The sequence lock protocol of perf_event_mmap_page, see "man perf_event_open".
+	 */
+	static bool read_mapped([[maybe_unused]] const perf_event_mmap_page *page, [[maybe_unused]] int64_t &value) {
+#if defined(__x86_64__) || defined(__i386__)
+		if (page == nullptr) { return false; }
+		const volatile perf_event_mmap_page *shared = page;
+		uint32_t                             sequence;
+		do {
+			sequence = shared->lock;
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+			const uint32_t index = shared->index;
+			if (!shared->cap_user_rdpmc || index == 0) { return false; }
+			const auto     shift = uint32_t(64 - shared->pmc_width);
+			const uint64_t raw   = uint64_t(__rdpmc(int(index - 1))) << shift;
+			value                = shared->offset + (int64_t(raw) >> shift); // sign extend to the counter width
+			std::atomic_signal_fence(std::memory_order_seq_cst);
+		} while (shared->lock != sequence);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/*
+	 * Counts kernel time as well if allowed, otherwise only user space.
+	 */
+	static int open_event(const Event &event, int group_fd) {
+		perf_event_attr attributes{};
+		attributes.type        = event.type;
+		attributes.size        = sizeof(attributes);
+		attributes.config      = event.config;
+		attributes.read_format = PERF_FORMAT_GROUP;
+		attributes.exclude_hv  = 1;
+		int fd                 = int(syscall(SYS_perf_event_open, &attributes, 0, -1, group_fd, 0));
+		if (fd < 0) {
+			attributes.exclude_kernel = 1;
+			fd                        = int(syscall(SYS_perf_event_open, &attributes, 0, -1, group_fd, 0));
+		}
+		return fd;
+	}
+
+	/*
+	 * Decided once for the process, so all threads count the same events.
+	 */
+	static Mode mode() {
+		static const Mode result = [] {
+			for (const Mode candidate: {Mode::hardware, Mode::software}) {
+				const Event &event = candidate == Mode::hardware ? hardware_events[0] : software_events[0];
+				const int    fd    = open_event(event, -1);
+				if (fd >= 0) {
+					close(fd);
+					return candidate;
+				}
+			}
+			std::cerr << "PerfCounters: perf_event_open is not available, see /proc/sys/kernel/perf_event_paranoid"
+					  << std::endl;
+			return Mode::unavailable;
+		}();
+		return result;
+	}
+
+	static Values read() {
+		thread_local const Group group(mode());
+		return group.read();
+	}
+
+	static const char *name(int counter) {
+		return (mode() == Mode::software ? software_events : hardware_events)[counter].name;
+	}
+
+	/*
+	 * Appends ", cycles 1234, instructions 5678, IPC 4.6, ..." for the given counter differences.
+	 * The values are divided by calls, for averages of aggregated code sections.
+	 */
+	template<class OUTPUT>
+	static void append(OUTPUT &output, const Values &difference, int64_t calls = 1) {
+		if (mode() == Mode::unavailable || calls == 0) { return; }
+		for (int i = 0; i < count; i++) {
+			output.append(", ");
+			output.append(name(i));
+			output.append(' ');
+			output.append_integer(difference[std::size_t(i)] / calls);
+			if (mode() == Mode::hardware && i == 1 && difference[0] != 0) {
+				output.append(", IPC ");
+				output.append_number(double(difference[1]) / double(difference[0]));
+			}
+		}
+	}
+
+	static Values difference(const Values &first, const Values &last) {
+		Values result{};
+		for (std::size_t i = 0; i < count; i++) { result[i] = last[i] - first[i]; }
+		return result;
+	}
+};
+#endif
+
+/**
+ * Interned event names, shared by all timers. Every distinct name is stored once and gets a 32 bit id, 0 is "".
+ * Ids are never reused, so names stay valid until the end of the program.
+ */
+struct NameTable {
+	std::deque<std::string>                        names{}; // indexed by id, a deque never moves its elements
+	std::unordered_map<std::string_view, uint32_t> ids{};   // the keys point into names
+	std::mutex                                     guard{};
+
+	NameTable() { intern(""); }
+
+	static NameTable &get() {
+		static NameTable table;
+		return table;
+	}
+
+	uint32_t intern(std::string_view name) {
+		std::lock_guard lock(guard);
+		if (const auto found = ids.find(name); found != ids.end()) { return found->second; }
+		const auto id = uint32_t(names.size());
+		ids.emplace(names.emplace_back(name), id);
+		return id;
+	}
+
+	/*
+	 * Most names are string literals, which are passed again and again with the same address. Every thread remembers
+	 * the last names by address, so looking them up takes no lock. The text is compared as well, in case the memory
+	 * was reused for another name.
+	 */
+	uint32_t intern_cached(const char *name) {
+		struct Entry {
+			const char      *address = nullptr;
+			std::string_view text{};
+			uint32_t         id = 0;
+		};
+		thread_local Entry cache[64];
+
+		const std::string_view text(name);
+		Entry &entry = cache[(uintptr_t(name) >> 3) % 64];
+		if (entry.address == name && entry.text == text) { return entry.id; }
+		entry.id      = intern(text);
+		entry.address = name;
+		entry.text    = this->name(entry.id);
+		return entry.id;
+	}
+
+	std::string_view name(uint32_t id) {
+		std::lock_guard lock(guard);
+		return names[id];
+	}
+
+	/*
+	 * The names interned so far, for formatting many events under a single lock, see Timer::name_snapshot().
+	 */
+	std::vector<std::string_view> snapshot() {
+		std::lock_guard lock(guard);
+		return {names.begin(), names.end()};
+	}
+};
+
+/**
+ * Compact event name for Timer<EventName>: an id in the NameTable instead of the text.
+ * TimeStamp<EventName> is 16 bytes (name id, thread index and time stamp), and adding an event with a string literal
+ * neither allocates nor locks. Names can also be interned up front, e.g. "const EventName parse("parse");".
+ */
+struct EventName {
+	uint32_t id = 0;
+
+	EventName() = default;
+	EventName(const char *name) : id(name == nullptr ? 0 : NameTable::get().intern_cached(name)) {} // 0 is ""
+	EventName(std::string_view name) : id(NameTable::get().intern(name)) {}
+	EventName(const std::string &name) : id(NameTable::get().intern(name)) {}
+
+	operator std::string_view() const { return NameTable::get().name(id); }
+
+	friend bool operator==(const EventName &first, const EventName &second) { return first.id == second.id; }
+
+	friend bool operator!=(const EventName &first, const EventName &second) { return first.id != second.id; }
+
+	friend bool operator<(const EventName &first, const EventName &second) { return first.id < second.id; }
+
+	friend std::ostream &operator<<(std::ostream &output, const EventName &name) {
+		return output << std::string_view(name);
+	}
+};
+
+#if __cplusplus >= 202002L
+/**
+ * A string literal as template argument, e.g. Timer::add<"parse">().
+ * Every distinct name is a distinct template instance, so names are deduplicated by the compiler.
+ */
+template<std::size_t LENGTH>
+struct FixedString {
+	char text[LENGTH]{};
+
+	constexpr FixedString(const char (&literal)[LENGTH]) { std::copy_n(literal, LENGTH, text); }
+
+	[[nodiscard]] constexpr std::string_view view() const { return {text, LENGTH - 1}; }
+};
+
+/**
+ * The interned name of a compile time name. It is interned on first use, after that it is a guarded static load.
+ */
+template<FixedString NAME>
+EventName static_event_name() {
+	static const EventName name(NAME.view());
+	return name;
+}
+#endif
+
+template<class NAME_TYPE = int, class CLOCK = TIMER_DEFAULT_CLOCK>
+struct TimeStamp {
+	using CLOCK_TYPE = CLOCK;
+
+	const NAME_TYPE name;
+#ifdef TIMER_THREADS
+	const uint16_t thread_index;
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+	const uint16_t thread_generation = this_thread_lease().generation; // see ThreadIndexAllocator
+#endif
+#endif
+#ifdef TIMER_PERF_COUNTERS
+	const PerfCounters::Values counters = PerfCounters::read();
+#endif
+#ifdef TIMER_CPU_TIME
+	const int64_t cpu_time = get_thread_cpu_time_ns();
+#endif
+	const int64_t time_stamp = CLOCK::now(); // raw clock ticks, read last
+
+#ifdef TIMER_THREADS
+	explicit TimeStamp(NAME_TYPE id, uint16_t thread_index) : name(id), thread_index(thread_index) {}
+	explicit TimeStamp(NAME_TYPE id) : name(id), thread_index(get_thread_index()) {}
+#else
+	explicit TimeStamp(NAME_TYPE id) : name(id) {}
+#endif
+
+	/**
+	 * @return The time between both time stamps in nanoseconds.
+	 */
+	static int64_t get_diff(const TimeStamp &first, const TimeStamp &last) {
+		return CLOCK::to_ns(last.time_stamp - first.time_stamp);
+	}
+
+
+	static std::string to_string(int64_t time) {
+		char buffer[max_duration_length];
+		return std::string(buffer, format_duration(buffer, time));
+	}
+};
+
+#if !defined(TIMER_PERF_COUNTERS) && !defined(TIMER_CPU_TIME)
+static_assert(sizeof(TimeStamp<EventName>) == 16, "An event with an interned name should fit into 16 bytes");
+#endif
+
+/**
+ * Overhead subtraction using "#define TIMER_SUBTRACT_OVERHEAD".
+ * Every interval includes part of the cost of the library itself (reading the clock, locking, storing the event).
+ * With TIMER_SUBTRACT_OVERHEAD it is measured in Timer::initialize(), once per Timer type since storage and name type
+ * change the cost of add(), and subtracted from Timer::get_time_since_last(), Timer::get_time_since_init() and the
+ * code section timers (wall and CPU time). Code sections used without any Timer calibrate when the first one ends.
+ * TimerOverhead<CLOCK>::print() shows the calibration, the standard deviation is the noise floor of a measurement.
+ */
+struct OverheadEstimate {
+	int64_t median   = 0; // raw clock ticks
+	double  mean     = 0;
+	double  variance = 0; // squared raw clock ticks
+
+	static OverheadEstimate from_samples(std::vector<int64_t> samples) {
+		OverheadEstimate result;
+		if (samples.empty()) { return result; }
+		std::sort(samples.begin(), samples.end());
+		result.median = samples[samples.size() / 2];
+		for (const int64_t sample: samples) { result.mean += double(sample); }
+		result.mean /= double(samples.size());
+		for (const int64_t sample: samples) {
+			result.variance += (double(sample) - result.mean) * (double(sample) - result.mean);
+		}
+		result.variance /= double(samples.size());
+		return result;
+	}
+};
+
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct TimerOverhead {
+	static constexpr int samples = 10'000;
+
+	/**
+	 * Cost included in every interval between two events of a Timer<int, CLOCK>, see Timer::event_overhead().
+	 * Defined after Timer.
+	 */
+	static const OverheadEstimate &timer_event();
+
+	/**
+	 * Cost included in every code section, measured with back to back time stamps.
+	 */
+	static const OverheadEstimate &code_section() {
+		static const OverheadEstimate result = [] {
+			std::vector<int64_t> ticks;
+			ticks.reserve(samples);
+			for (int i = 0; i < samples; i++) {
+				const TimeStamp<const char *, CLOCK> start("");
+				const TimeStamp<const char *, CLOCK> end("");
+				ticks.push_back(end.time_stamp - start.time_stamp);
+			}
+			return OverheadEstimate::from_samples(std::move(ticks));
+		}();
+		return result;
+	}
+
+	/*
+	 * Removes the overhead of a code section from its duration in raw clock ticks.
+	 */
+	static int64_t subtract_code_section(int64_t ticks) {
+#ifdef TIMER_SUBTRACT_OVERHEAD
+		return std::max(int64_t(0), ticks - code_section().median);
+#else
+		return ticks;
+#endif
+	}
+
+	/*
+	 * Removes the same overhead from the CPU time of a code section in nanoseconds, the clock reads cost CPU time too.
+	 */
+	static int64_t subtract_code_section_cpu_time(int64_t ns) {
+#ifdef TIMER_SUBTRACT_OVERHEAD
+		return std::max(int64_t(0), ns - CLOCK::to_ns(code_section().median));
+#else
+		return ns;
+#endif
+	}
+
+	static void print() {
+		print_to_output_sink([](std::ostream &output) { print(output); });
+	}
+
+	static void print(std::ostream &output) {
+		const auto print_estimate = [&](const char *name, const OverheadEstimate &estimate) {
+			output << "\t" << name << " : median " << TimeStamp<>::to_string(CLOCK::to_ns(estimate.median))
+				   << ", mean " << TimeStamp<>::to_string(CLOCK::to_ns(int64_t(estimate.mean))) << ", stddev "
+				   << TimeStamp<>::to_string(CLOCK::to_ns(int64_t(std::sqrt(estimate.variance)))) << "\n";
+		};
+		output << "Timer overhead :\n";
+		print_estimate("Timer event", timer_event());
+		print_estimate("Code section", code_section());
+	}
+};
+
+/**
+ * Streams events in the Chrome Trace Event format, which opens in chrome://tracing or https://ui.perfetto.dev.
+ * Each event is formatted on the stack and handed to a FileSink, which writes whole pages,
+ * so traces of any length never have to fit into memory.
+ * Timer events are written with Timer::export_trace(), code sections are added while they finish after
+ * calling attach_code_sections(). Times are in microseconds of the steady clock.
+ */
+struct TraceEventWriter {
+	/*
+	 * Process ids used to keep Timer threads and code section threads apart.
+	 */
+	static constexpr int timer_process   = 1;
+	static constexpr int section_process = 2;
+
+	/*
+	 * Holds one event, FileSink collects them into pages.
+	 */
+	using Event = OutputBuffer<256>;
+
+	FileSink   file;
+	bool       open        = file.is_open();
+	bool       first_event = true;
+	std::mutex guard{};
+
+	explicit TraceEventWriter(const char *path) : file(path, false) {
+		if (!open) { return; }
+		file.write("{\"traceEvents\":[\n");
+		process_name(timer_process, "Timer");
+		process_name(section_process, "Code sections");
+	}
+
+	TraceEventWriter(const TraceEventWriter &) = delete;
+	void operator=(const TraceEventWriter &)   = delete;
+	~TraceEventWriter() { close(); }
+
+	[[nodiscard]] bool is_open() const { return open; }
+
+	/*
+	 * The writer code sections report to, or nullptr.
+	 */
+	static std::atomic<TraceEventWriter *> &code_section_writer() {
+		static std::atomic<TraceEventWriter *> writer{nullptr};
+		return writer;
+	}
+
+	/**
+	 * Every CodeSectionTimer which finishes from now on is written to this trace.
+	 * Detach (or destroy the writer) only when no code section can finish concurrently.
+	 */
+	void attach_code_sections() { code_section_writer().store(this, std::memory_order_release); }
+
+	void detach_code_sections() {
+		TraceEventWriter *expected = this;
+		code_section_writer().compare_exchange_strong(expected, nullptr);
+	}
+
+	/**
+	 * Writes the end of the trace and closes the file. Called by the destructor.
+	 */
+	void close() {
+		detach_code_sections();
+		std::lock_guard lock(guard);
+		if (!open) { return; }
+		file.write("\n],\"displayTimeUnit\":\"ns\"}\n");
+		file.flush();
+		open = false;
+	}
+
+	/**
+	 * An event with a duration ("ph":"X"). Times are in nanoseconds of the steady clock.
+	 */
+	template<class NAME_TYPE>
+	void complete_event(const NAME_TYPE &name, const char *category, int process, int thread, int64_t start_ns,
+						int64_t duration_ns) {
+		std::lock_guard lock(guard);
+		if (!open) { return; }
+		Event event(file);
+		begin_event(event);
+		event.append("{\"name\":\"");
+		append_name(event, name);
+		event.append("\",\"cat\":\"");
+		event.append(category);
+		event.append("\",\"ph\":\"X\",\"pid\":");
+		event.append_integer(process);
+		event.append(",\"tid\":");
+		event.append_integer(thread);
+		event.append(",\"ts\":");
+		append_microseconds(event, start_ns);
+		event.append(",\"dur\":");
+		append_microseconds(event, duration_ns);
+		event.append('}');
+	}
+
+	/**
+	 * An event without duration ("ph":"i"), scoped to its thread.
+	 */
+	template<class NAME_TYPE>
+	void instant_event(const NAME_TYPE &name, const char *category, int process, int thread, int64_t time_ns) {
+		std::lock_guard lock(guard);
+		if (!open) { return; }
+		Event event(file);
+		begin_event(event);
+		event.append("{\"name\":\"");
+		append_name(event, name);
+		event.append("\",\"cat\":\"");
+		event.append(category);
+		event.append("\",\"ph\":\"i\",\"s\":\"t\",\"pid\":");
+		event.append_integer(process);
+		event.append(",\"tid\":");
+		event.append_integer(thread);
+		event.append(",\"ts\":");
+		append_microseconds(event, time_ns);
+		event.append('}');
+	}
+
+	void thread_name(int process, int thread, std::string_view name) {
+		std::lock_guard lock(guard);
+		if (!open) { return; }
+		Event event(file);
+		begin_event(event);
+		event.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+		event.append_integer(process);
+		event.append(",\"tid\":");
+		event.append_integer(thread);
+		event.append(",\"args\":{\"name\":\"");
+		append_escaped(event, name);
+		event.append("\"}}");
+	}
+
+private:
+	void process_name(int process, std::string_view name) {
+		Event event(file);
+		begin_event(event);
+		event.append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+		event.append_integer(process);
+		event.append(",\"args\":{\"name\":\"");
+		append_escaped(event, name);
+		event.append("\"}}");
+	}
+
+	/*
+	 * Separates events.
+	 */
+	void begin_event(Event &event) {
+		if (!first_event) { event.append(",\n"); }
+		first_event = false;
+	}
+
+	static void append_escaped(Event &event, std::string_view text) {
+		for (const char c: text) {
+			if (c == '"' || c == '\\') {
+				event.append('\\');
+				event.append(c);
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				constexpr char hex[]     = "0123456789abcdef";
+				const char     escaped[] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xf], hex[c & 0xf]};
+				event.append(std::string_view(escaped, sizeof(escaped)));
+			} else {
+				event.append(c);
+			}
+		}
+	}
+
+	/*
+	 * Nanoseconds as microseconds with three decimals, without going through floating point.
+	 */
+	static void append_microseconds(Event &event, int64_t ns) {
+		if (ns < 0) {
+			event.append('-');
+			ns = -ns;
+		}
+		event.append_integer(ns / 1000);
+		const char decimals[] = {'.', char('0' + ns / 100 % 10), char('0' + ns / 10 % 10), char('0' + ns % 10)};
+		event.append(std::string_view(decimals, sizeof(decimals)));
+	}
+
+	template<class NAME_TYPE>
+	static void append_name(Event &event, const NAME_TYPE &name) {
+		if constexpr (std::is_same_v<NAME_TYPE, const char *>) {
+			append_escaped(event, name == nullptr ? "" : name);
+		} else if constexpr (std::is_convertible_v<const NAME_TYPE &, std::string_view>) {
+			append_escaped(event, name);
+		} else if constexpr (std::is_integral_v<NAME_TYPE>) {
+			event.append_integer(int64_t(name));
+		} else {
+			std::ostringstream text;
+			text << name;
+			append_escaped(event, text.str());
+		}
+	}
+};
+
+/**
+ * The file header of a binary trace, see BinaryTraceWriter. Times are stored in raw clock ticks,
+ * steady ns = anchor_ns + ticks * ns_per_tick.
+ */
+struct BinaryTraceHeader {
+	static constexpr uint64_t magic_value   = 0x43525452454D4954; // "TIMERTRC" in little endian
+	static constexpr uint32_t version_value = 1;
+
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	double   ns_per_tick;
+	int64_t  anchor_ns;
+};
+static_assert(sizeof(BinaryTraceHeader) == 32, "The header is written as it is");
+
+/**
+ * Streams events in a compact binary format, written with Timer::export_binary_trace() and read with
+ * BinaryTraceReader or ./trace_dump. Events are encoded into blocks, which are written whenever they fill up,
+ * so like TraceEventWriter only one block is kept in memory.
+ *
+ * After the BinaryTraceHeader the file is a sequence of blocks:
+ * uint32 payload size, then as varints the event count, the number of new names and the names themselves
+ * (length and text), the time of the first event, and for every event its name index, its thread and its time
+ * as zigzag delta to the previous event. A name is defined in the block which first uses it, so names are never
+ * repeated and a trace cut short (e.g. by a crash) is readable up to its last complete block.
+ * An event typically takes 3 to 4 bytes instead of about 40 bytes of log() text.
+ * The timer's own storage is the batch: call export_binary_trace() when a phase is done, or use one timer per batch
+ * with a single writer, which then streams all of them into one file.
+ */
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct BinaryTraceWriter {
+	static constexpr std::size_t block_events = 4096;
+
+	std::ofstream                                  file;
+	std::deque<std::string>                        names{};        // a deque never moves its elements
+	std::unordered_map<std::string_view, uint32_t> name_ids{};     // the keys point into names
+	std::unordered_map<const void *, uint32_t>     pointer_ids{};  // const char * names by address
+	std::unordered_map<int64_t, uint32_t>          integer_ids{};  // integral names by value
+	std::unordered_map<uint32_t, uint32_t>         interned_ids{}; // EventName by NameTable id
+	std::string                                    new_names{};
+	std::string                                    events{};
+	uint64_t                                       new_name_count = 0;
+	uint64_t                                       event_count    = 0;
+	int64_t                                        first_ticks    = 0; // of the current block
+	int64_t                                        previous_ticks = 0;
+
+	explicit BinaryTraceWriter(const char *path) : file(path, std::ios::binary) {
+		if (!file) {
+			std::cerr << "BinaryTraceWriter: can not open " << path << std::endl;
+			return;
+		}
+		BinaryTraceHeader header{};
+		header.magic       = BinaryTraceHeader::magic_value;
+		header.version     = BinaryTraceHeader::version_value;
+		header.ns_per_tick = double(CLOCK::to_ns(1'000'000'000)) / 1e9;
+		header.anchor_ns   = CLOCK::to_steady_ns(0);
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		events.reserve(block_events * 4);
+	}
+
+	BinaryTraceWriter(const BinaryTraceWriter &) = delete;
+	void operator=(const BinaryTraceWriter &)    = delete;
+	~BinaryTraceWriter() { close(); }
+
+	[[nodiscard]] bool is_open() const { return file.is_open(); }
+
+	/**
+	 * Writes the last block and closes the file. Called by the destructor.
+	 */
+	void close() {
+		if (!file.is_open()) { return; }
+		flush();
+		file.close();
+	}
+
+	/**
+	 * Adds an event, time in raw ticks of CLOCK.
+	 */
+	template<class NAME_TYPE>
+	void event(const NAME_TYPE &name, uint32_t thread, int64_t ticks) {
+		if (!file.is_open()) { return; }
+		if (event_count == 0) {
+			first_ticks    = ticks;
+			previous_ticks = ticks;
+		}
+		append_varint(events, name_id(name));
+		append_varint(events, thread);
+		append_varint(events, zigzag(ticks - previous_ticks));
+		previous_ticks = ticks;
+		if (++event_count == block_events) { flush(); }
+	}
+
+	/**
+	 * Writes the current block, even if it is not full.
+	 */
+	void flush() {
+		if (event_count == 0 || !file.is_open()) { return; }
+		std::string block_header;
+		append_varint(block_header, event_count);
+		append_varint(block_header, new_name_count);
+		std::string first_time;
+		append_varint(first_time, zigzag(first_ticks));
+
+		const std::size_t   payload = block_header.size() + new_names.size() + first_time.size() + events.size();
+		const unsigned char size[]  = {uint8_t(payload), uint8_t(payload >> 8), uint8_t(payload >> 16),
+									   uint8_t(payload >> 24)};
+		file.write(reinterpret_cast<const char *>(size), sizeof(size));
+		file.write(block_header.data(), std::streamsize(block_header.size()));
+		file.write(new_names.data(), std::streamsize(new_names.size()));
+		file.write(first_time.data(), std::streamsize(first_time.size()));
+		file.write(events.data(), std::streamsize(events.size()));
+		new_names.clear();
+		events.clear();
+		new_name_count = 0;
+		event_count    = 0;
+	}
+
+	static void append_varint(std::string &output, uint64_t value) {
+		while (value >= 0x80) {
+			output.push_back(char(uint8_t(value) | 0x80));
+			value >>= 7;
+		}
+		output.push_back(char(value));
+	}
+
+	static uint64_t zigzag(int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+
+private:
+	/*
+	 * Names which can be looked up without their text (addresses, integers and interned ids) are cached by that key,
+	 * so only their first event converts them to text. An address is compared with its text as well, in case the
+	 * memory was reused for another name.
+	 */
+	template<class NAME_TYPE>
+	uint32_t name_id(const NAME_TYPE &name) {
+		if constexpr (std::is_same_v<NAME_TYPE, const char *>) {
+			const std::string_view text = name == nullptr ? "" : name;
+			const auto [entry, inserted] = pointer_ids.try_emplace(name, 0);
+			if (inserted || names[entry->second] != text) { entry->second = text_id(text); }
+			return entry->second;
+		} else if constexpr (std::is_same_v<NAME_TYPE, EventName>) {
+			const auto [entry, inserted] = interned_ids.try_emplace(name.id, 0);
+			if (inserted) { entry->second = text_id(name); }
+			return entry->second;
+		} else if constexpr (std::is_integral_v<NAME_TYPE>) {
+			const auto [entry, inserted] = integer_ids.try_emplace(int64_t(name), 0);
+			if (inserted) { entry->second = text_id(std::to_string(name)); }
+			return entry->second;
+		} else if constexpr (std::is_convertible_v<const NAME_TYPE &, std::string_view>) {
+			return text_id(name);
+		} else {
+			std::ostringstream stream;
+			stream << name;
+			return text_id(stream.str());
+		}
+	}
+
+	/*
+	 * Looks up a name by its text, new names are added to the current block.
+	 */
+	uint32_t text_id(std::string_view text) {
+		if (const auto found = name_ids.find(text); found != name_ids.end()) { return found->second; }
+		const auto id = uint32_t(names.size());
+		name_ids.emplace(names.emplace_back(text), id);
+		append_varint(new_names, text.size());
+		new_names.append(text);
+		new_name_count++;
+		return id;
+	}
+};
+
+/**
+ * Reads a trace of BinaryTraceWriter. The whole file is loaded at once, events are decoded while iterating:
+ *
+ *	BinaryTraceReader trace("trace.bin");
+ *	trace.for_each([&](const BinaryTraceReader::Event &event) { std::cout << trace.names[event.name] << "\n"; });
+ */
+struct BinaryTraceReader {
+	struct Event {
+		uint32_t name; // index into names
+		uint32_t thread;
+		int64_t  ticks;
+	};
+
+	BinaryTraceHeader        header{};
+	std::vector<std::string> names{}; // filled while iterating, names are defined before the events using them
+	std::string              data{};
+	bool                     valid = false;
+
+	explicit BinaryTraceReader(const char *path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			std::cerr << "BinaryTraceReader: can not open " << path << std::endl;
+			return;
+		}
+		data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		if (data.size() < sizeof(header)) {
+			std::cerr << "BinaryTraceReader: " << path << " is too short" << std::endl;
+			return;
+		}
+		std::memcpy(&header, data.data(), sizeof(header));
+		if (header.magic != BinaryTraceHeader::magic_value || header.version != BinaryTraceHeader::version_value) {
+			std::cerr << "BinaryTraceReader: " << path << " is not a binary trace of this version" << std::endl;
+			return;
+		}
+		valid = true;
+	}
+
+	[[nodiscard]] bool is_open() const { return valid; }
+
+	[[nodiscard]] int64_t to_ns(int64_t ticks) const { return int64_t(double(ticks) * header.ns_per_tick); }
+
+	[[nodiscard]] int64_t to_steady_ns(int64_t ticks) const { return header.anchor_ns + to_ns(ticks); }
+
+	/**
+	 * Calls function(const Event &) for every event and returns the number of events.
+	 * Stops with an error message at a damaged or incomplete block.
+	 */
+	template<class FUNCTION>
+	uint64_t for_each(FUNCTION &&function) {
+		names.clear();
+		if (!valid) { return 0; }
+		uint64_t             count    = 0;
+		const unsigned char *position = reinterpret_cast<const unsigned char *>(data.data()) + sizeof(header);
+		const unsigned char *end      = reinterpret_cast<const unsigned char *>(data.data()) + data.size();
+		while (position != end) {
+			if (end - position < 4) { return incomplete(count); }
+			const std::size_t payload = std::size_t(position[0]) | std::size_t(position[1]) << 8 |
+										std::size_t(position[2]) << 16 | std::size_t(position[3]) << 24;
+			position += 4;
+			if (std::size_t(end - position) < payload) { return incomplete(count); }
+			const unsigned char *block_end = position + payload;
+
+			uint64_t event_count;
+			uint64_t name_count;
+			uint64_t first_time;
+			if (!read_varint(position, block_end, event_count) || !read_varint(position, block_end, name_count)) {
+				return incomplete(count);
+			}
+			for (uint64_t i = 0; i < name_count; i++) {
+				uint64_t length;
+				if (!read_varint(position, block_end, length) || uint64_t(block_end - position) < length) {
+					return incomplete(count);
+				}
+				names.emplace_back(reinterpret_cast<const char *>(position), std::size_t(length));
+				position += length;
+			}
+			if (!read_varint(position, block_end, first_time)) { return incomplete(count); }
+
+			Event event{0, 0, unzigzag(first_time)};
+			for (uint64_t i = 0; i < event_count; i++) {
+				uint64_t name;
+				uint64_t thread;
+				uint64_t delta;
+				if (!read_varint(position, block_end, name) || !read_varint(position, block_end, thread) ||
+					!read_varint(position, block_end, delta) || name >= names.size()) {
+					return incomplete(count);
+				}
+				event.name   = uint32_t(name);
+				event.thread = uint32_t(thread);
+				event.ticks += unzigzag(delta);
+				function(static_cast<const Event &>(event));
+			}
+			count += event_count;
+			position = block_end;
+		}
+		return count;
+	}
+
+	static bool read_varint(const unsigned char *&position, const unsigned char *end, uint64_t &value) {
+		value = 0;
+		for (int shift = 0; position != end && shift < 64; shift += 7) {
+			const unsigned char byte = *position++;
+			value |= uint64_t(byte & 0x7f) << shift;
+			if (byte < 0x80) { return true; }
+		}
+		return false;
+	}
+
+	static int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+private:
+	static uint64_t incomplete(uint64_t count) {
+		std::cerr << "BinaryTraceReader: the trace is damaged or incomplete after " << count << " events" << std::endl;
+		return count;
+	}
+};
+
+#ifdef TIMER_ASYNC_OUTPUT
+/**
+ * What a thread does when its output queue is full, see AsyncOutput.
+ */
+enum class BackpressurePolicy {
+	drop,           // the record is lost, AsyncOutput::dropped_records() counts it
+	block,          // the thread waits until the background thread made room
+	count_overflow, // like drop, but the output says how many records were lost at that point
+};
+
+/**
+ * The background thread of TIMER_ASYNC_OUTPUT. Every producing thread gets its own single producer single consumer
+ * queue of fixed size records, so pushing a record takes no lock and shares no cache line with other threads.
+ * The background thread formats the records of all queues into one buffer and writes it in batches.
+ * A record is a trivially copyable entry with a "void append(OutputBuffer<> &) const" member, which formats it, and a
+ * "static constexpr bool format_later", false if it points to data which may be gone by the time it is formatted.
+ *
+ * It writes to output_sink(). The reports of the registries and Timer::log_histograms() are queued as text, so the
+ * output of a thread stays in order. Configure it before the first output: AsyncOutput::get().policy = ...
+ * AsyncOutput::get().flush() waits until everything pushed so far is written, which also happens at exit.
+ * Output during static destruction after that is written synchronously.
+ */
+struct AsyncOutput {
+	static constexpr std::size_t queue_capacity = 1024;
+	static constexpr std::size_t payload_size   = 120;
+
+	struct Record {
+		void (*format)(const Record &, OutputBuffer<> &);
+		alignas(8) unsigned char payload[payload_size];
+	};
+
+	struct Queue {
+		alignas(64) std::atomic<uint64_t> head{0}; // written by the producer
+		alignas(64) std::atomic<uint64_t> tail{0}; // written by the background thread, after the records are written
+		std::atomic<uint64_t>             overflow{0};
+		std::atomic<bool>                 owned{true}; // false after the thread exited, the queue is reused
+		std::array<Record, queue_capacity> records{};
+	};
+
+	std::atomic<BackpressurePolicy>     policy{BackpressurePolicy::count_overflow};
+	std::vector<std::unique_ptr<Queue>> queues{};
+	std::mutex                          guard{}; // queues
+	std::atomic<Sink *>                &sink = output_sink(); // constructed first, so it is destroyed last
+	std::atomic<uint64_t>               dropped{0};
+	std::atomic<bool>                   stopping{false};
+	std::mutex                          wake_guard{};
+	std::condition_variable             wake{};    // wakes the background thread
+	std::condition_variable             written{}; // wakes flush() after a batch
+	std::thread                         worker{[this] { run(); }};
+
+	static inline std::atomic<bool> destroyed{false}; // outlives the instance, see push() and write()
+
+	static AsyncOutput &get() {
+		static AsyncOutput output;
+		return output;
+	}
+
+	AsyncOutput() = default;
+	AsyncOutput(const AsyncOutput &)    = delete;
+	void operator=(const AsyncOutput &) = delete;
+
+	/*
+	 * Writes the remaining records. Records pushed from now on are written synchronously.
+	 */
+	~AsyncOutput() {
+		destroyed.store(true);
+		stopping.store(true);
+		wake.notify_one();
+		worker.join();
+	}
+
+	[[nodiscard]] uint64_t dropped_records() const { return dropped.load(std::memory_order_relaxed); }
+
+	/**
+	 * Queues an entry of the calling thread. Entries which are not trivially copyable, too large or not safe to
+	 * format later are formatted on the calling thread, only writing them is left to the background thread.
+	 */
+	template<class ENTRY>
+	static void push(const ENTRY &entry) {
+		if (destroyed.load(std::memory_order_acquire)) {
+			OutputBuffer<256> output(*output_sink().load(std::memory_order_acquire));
+			entry.append(output);
+			return;
+		}
+		AsyncOutput &output = get();
+		if constexpr (std::is_trivially_copyable_v<ENTRY> && sizeof(ENTRY) <= payload_size && alignof(ENTRY) <= 8 &&
+					  ENTRY::format_later) {
+			Record record;
+			record.format = &format_entry<ENTRY>;
+			std::memcpy(record.payload, &entry, sizeof(ENTRY));
+			output.push_record(record, output.policy.load(std::memory_order_relaxed));
+		} else {
+			std::ostringstream text;
+			{
+				OutputBuffer<256> formatted(text);
+				entry.append(formatted);
+			}
+			write(text.str(), output.policy.load(std::memory_order_relaxed));
+		}
+	}
+
+	/**
+	 * Queues formatted text, by default without ever dropping it.
+	 */
+	static void write(std::string text, BackpressurePolicy text_policy = BackpressurePolicy::block) {
+		if (destroyed.load(std::memory_order_acquire)) {
+			output_sink().load(std::memory_order_acquire)->write(text);
+			return;
+		}
+		Record record;
+		record.format = &format_text;
+		auto *owned   = new std::string(std::move(text));
+		std::memcpy(record.payload, &owned, sizeof(owned));
+		if (!get().push_record(record, text_policy)) { delete owned; }
+	}
+
+	/**
+	 * Waits until everything pushed so far is written.
+	 */
+	void flush() {
+		std::unique_lock lock(wake_guard);
+		while (!drained()) {
+			wake.notify_one();
+			written.wait(lock);
+		}
+	}
+
+private:
+	template<class ENTRY>
+	static void format_entry(const Record &record, OutputBuffer<> &buffer) {
+		ENTRY entry;
+		std::memcpy(&entry, record.payload, sizeof(ENTRY));
+		entry.append(buffer);
+	}
+
+	static void format_text(const Record &record, OutputBuffer<> &buffer) {
+		std::string *text;
+		std::memcpy(&text, record.payload, sizeof(text));
+		buffer.append(*text);
+		delete text;
+	}
+
+	/*
+	 * The queue of the calling thread. It is given back when the thread exits, a later thread takes it over once
+	 * the background thread emptied it.
+	 */
+	Queue &this_thread_queue() {
+		struct Owner {
+			Queue *queue = nullptr;
+			~Owner() {
+				if (queue != nullptr) { queue->owned.store(false, std::memory_order_release); }
+			}
+		};
+		thread_local Owner owner;
+		if (owner.queue == nullptr) {
+			std::lock_guard lock(guard);
+			for (auto &queue: queues) {
+				if (!queue->owned.load(std::memory_order_acquire) &&
+					queue->tail.load(std::memory_order_acquire) == queue->head.load(std::memory_order_relaxed)) {
+					queue->owned.store(true, std::memory_order_relaxed);
+					owner.queue = queue.get();
+					break;
+				}
+			}
+			if (owner.queue == nullptr) { owner.queue = queues.emplace_back(std::make_unique<Queue>()).get(); }
+		}
+		return *owner.queue;
+	}
+
+	bool push_record(const Record &record, BackpressurePolicy record_policy) {
+		Queue         &queue = this_thread_queue();
+		const uint64_t head  = queue.head.load(std::memory_order_relaxed);
+		while (head - queue.tail.load(std::memory_order_acquire) == queue_capacity) {
+			if (record_policy != BackpressurePolicy::block) {
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				if (record_policy == BackpressurePolicy::count_overflow) {
+					queue.overflow.fetch_add(1, std::memory_order_relaxed);
+				}
+				return false;
+			}
+			wake.notify_one();
+			std::this_thread::yield();
+		}
+		queue.records[head % queue_capacity] = record;
+		queue.head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool drained() {
+		std::lock_guard lock(guard);
+		for (auto &queue: queues) {
+			if (queue->tail.load(std::memory_order_acquire) != queue->head.load(std::memory_order_acquire)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * Formats whatever is queued, writes it, and only then frees the records. The stream is only touched if there is
+	 * something to write. Returns false if there was nothing to do.
+	 */
+	bool drain() {
+		std::lock_guard       lock(guard);
+		std::vector<uint64_t> heads(queues.size());
+		bool                  found = false;
+		for (std::size_t i = 0; i < queues.size(); i++) {
+			heads[i] = queues[i]->head.load(std::memory_order_acquire);
+			found |= heads[i] != queues[i]->tail.load(std::memory_order_relaxed) ||
+					 queues[i]->overflow.load(std::memory_order_relaxed) != 0;
+		}
+		if (!found) { return false; }
+		Sink &target = *sink.load(std::memory_order_acquire);
+		{
+			const auto buffer = std::make_unique<OutputBuffer<>>(target);
+			for (std::size_t i = 0; i < queues.size(); i++) {
+				Queue &queue = *queues[i];
+				for (uint64_t position = queue.tail.load(std::memory_order_relaxed); position != heads[i]; position++) {
+					const Record &record = queue.records[position % queue_capacity];
+					record.format(record, *buffer);
+				}
+				if (const uint64_t lost = queue.overflow.exchange(0, std::memory_order_relaxed)) {
+					buffer->append("(");
+					buffer->append_integer(int64_t(lost));
+					buffer->append(" records dropped)\n");
+				}
+			}
+		}
+		target.flush();
+		for (std::size_t i = 0; i < queues.size(); i++) {
+			queues[i]->tail.store(heads[i], std::memory_order_release);
+		}
+		return true;
+	}
+
+	void run() {
+		while (true) {
+			const bool stop = stopping.load();
+			if (drain()) {
+				{
+					std::lock_guard lock(wake_guard); // flush() is either waiting or has not checked drained() yet
+				}
+				written.notify_all();
+				continue;
+			}
+			if (stop) { return; }
+			std::unique_lock lock(wake_guard);
+			wake.wait_for(lock, std::chrono::milliseconds(1));
+		}
+	}
+};
+#endif
+
+/*
+ * With TIMER_ASYNC_OUTPUT the report is queued behind the output of the calling thread, so it keeps its order.
+ */
+template<class PRINT>
+void print_to_output_sink(PRINT print) {
+	std::ostringstream text;
+	print(text);
+#ifdef TIMER_ASYNC_OUTPUT
+	AsyncOutput::write(text.str());
+#else
+	Sink &sink = *output_sink().load(std::memory_order_acquire);
+	sink.write(text.str());
+	sink.flush();
+#endif
+}
+
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct CodeSectionTimer {
+	using TimeStampType = TimeStamp<const char *, CLOCK>;
+	const TimeStampType start;
+
+	explicit CodeSectionTimer(const char *name) : start(name) {}
+	CodeSectionTimer(CodeSectionTimer &)  = delete;
+	CodeSectionTimer(CodeSectionTimer &&) = delete;
+	void operator=(CodeSectionTimer &)    = delete;
+
+	/*
+	 * The line printed for a section, formatted by the background thread with TIMER_ASYNC_OUTPUT.
+	 * The names of the code section macros are function names, which never go away.
+	 */
+	struct Report {
+		static constexpr bool format_later = true;
+
+		const char *name;
+		int64_t     duration_ns;
+#ifdef TIMER_CPU_TIME
+		int64_t cpu_time;
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		PerfCounters::Values counters;
+#endif
+
+		template<std::size_t CAPACITY>
+		void append(OutputBuffer<CAPACITY> &output) const {
+			output.append("Code section : ");
+			output.append_name(name);
+			output.append(" took ");
+			output.append_duration(duration_ns);
+#ifdef TIMER_CPU_TIME
+			output.append_cpu_time(duration_ns, cpu_time);
+#endif
+#ifdef TIMER_PERF_COUNTERS
+			PerfCounters::append(output, counters);
+#endif
+			output.append('\n');
+		}
+	};
+
+	~CodeSectionTimer() {
+		const TimeStampType end("");
+
+		const int64_t duration = TimerOverhead<CLOCK>::subtract_code_section(end.time_stamp - start.time_stamp);
+
+		Report report{};
+		report.name        = start.name;
+		report.duration_ns = CLOCK::to_ns(duration);
+#ifdef TIMER_CPU_TIME
+		report.cpu_time = TimerOverhead<CLOCK>::subtract_code_section_cpu_time(end.cpu_time - start.cpu_time);
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		report.counters = PerfCounters::difference(start.counters, end.counters);
+#endif
+#ifdef TIMER_ASYNC_OUTPUT
+		AsyncOutput::push(report);
+#else
+		{
+			OutputBuffer<256> output(*output_sink().load(std::memory_order_acquire));
+			report.append(output);
+		}
+#endif
+		if (auto *writer = TraceEventWriter::code_section_writer().load(std::memory_order_acquire)) {
+			writer->complete_event(start.name, "section", TraceEventWriter::section_process,
+								   get_thread_index(), CLOCK::to_steady_ns(start.time_stamp),
+								   TimeStampType::get_diff(start, end));
+		}
+	}
+};
+
+/*
+ * Relaxed updates of statistics shared between threads. Without thread safety plain loads and stores are enough,
+ * which avoids the locked instructions.
+ */
+inline void relaxed_add(std::atomic<int64_t> &value, int64_t amount) {
+#ifdef TIMER_THREADS
+	value.fetch_add(amount, std::memory_order_relaxed);
+#else
+	value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+#endif
+}
+
+inline void relaxed_min(std::atomic<int64_t> &value, int64_t candidate) {
+	int64_t current = value.load(std::memory_order_relaxed);
+	while (candidate < current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+}
+
+inline void relaxed_max(std::atomic<int64_t> &value, int64_t candidate) {
+	int64_t current = value.load(std::memory_order_relaxed);
+	while (candidate > current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+}
+
+inline int64_t identity_to_ns(int64_t ns) { return ns; }
+
+/**
+ * Fixed size log-linear (HDR style) histogram, e.g. of TimeStamp::get_diff() results or raw clock ticks.
+ * Values below 2^SUB_BUCKET_BITS are counted exactly, above that every power of two is split into
+ * 2^(SUB_BUCKET_BITS - 1) buckets, which bounds the relative error to 2^(1 - SUB_BUCKET_BITS).
+ * record() is O(1) and never allocates. Several threads may record into the same histogram,
+ * or each thread records into its own and they are combined with merge().
+ */
+template<int SUB_BUCKET_BITS = 6>
+struct LatencyHistogram {
+	static_assert(SUB_BUCKET_BITS >= 2 && SUB_BUCKET_BITS < 32);
+
+	static constexpr int64_t sub_bucket_count      = int64_t(1) << SUB_BUCKET_BITS;
+	static constexpr int64_t half_sub_bucket_count = sub_bucket_count / 2;
+	static constexpr int64_t bucket_count          = sub_bucket_count + (64 - SUB_BUCKET_BITS) * half_sub_bucket_count;
+
+	std::atomic<int64_t> counts[bucket_count]{};
+	std::atomic<int64_t> count{0};
+	std::atomic<int64_t> min{std::numeric_limits<int64_t>::max()};
+	std::atomic<int64_t> max{0};
+
+	static int64_t bucket_index(int64_t value) {
+		if (value < sub_bucket_count) { return value < 0 ? 0 : value; }
+		const int     exponent = 63 - __builtin_clzll(uint64_t(value));
+		const int     shift    = exponent - SUB_BUCKET_BITS + 1;
+		const int64_t top      = value >> shift; // in [half_sub_bucket_count, sub_bucket_count)
+		return sub_bucket_count + (shift - 1) * half_sub_bucket_count + (top - half_sub_bucket_count);
+	}
+
+	/*
+	 * The highest value which falls into the bucket.
+	 */
+	static int64_t bucket_upper_bound(int64_t index) {
+		if (index < sub_bucket_count) { return index; }
+		const int64_t offset = index - sub_bucket_count;
+		const int     shift  = int(offset / half_sub_bucket_count) + 1;
+		const int64_t top    = offset % half_sub_bucket_count + half_sub_bucket_count;
+		return int64_t((uint64_t(top + 1) << shift) - 1);
+	}
+
+	void record(int64_t value) {
+		relaxed_add(counts[bucket_index(value)], 1);
+		relaxed_add(count, 1);
+		relaxed_min(min, value);
+		relaxed_max(max, value);
+	}
+
+	/*
+	 * For histograms only one thread writes to, e.g. of a LoopSection. Plain loads and stores, no locked instructions.
+	 */
+	void record_unshared(int64_t value) {
+		auto &bucket = counts[bucket_index(value)];
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		if (value < min.load(std::memory_order_relaxed)) { min.store(value, std::memory_order_relaxed); }
+		if (value > max.load(std::memory_order_relaxed)) { max.store(value, std::memory_order_relaxed); }
+	}
+
+	void merge(const LatencyHistogram &other) {
+		for (int64_t i = 0; i < bucket_count; i++) {
+			const int64_t other_count = other.counts[i].load(std::memory_order_relaxed);
+			if (other_count != 0) { relaxed_add(counts[i], other_count); }
+		}
+		relaxed_add(count, other.count.load(std::memory_order_relaxed));
+		relaxed_min(min, other.min.load(std::memory_order_relaxed));
+		relaxed_max(max, other.max.load(std::memory_order_relaxed));
+	}
+
+	void reset() {
+		for (auto &bucket: counts) { bucket.store(0, std::memory_order_relaxed); }
+		count.store(0, std::memory_order_relaxed);
+		min.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+	}
+
+	/**
+	 * @param percentile In the range [0, 100], e.g. 99.9.
+	 * @return The highest value of the bucket holding the percentile, but at most the maximum recorded value.
+	 */
+	[[nodiscard]] int64_t value_at_percentile(double percentile) const {
+		const int64_t total = count.load(std::memory_order_relaxed);
+		if (total == 0) { return 0; }
+		const auto rank = std::max(int64_t(1), int64_t(std::ceil(percentile / 100.0 * double(total))));
+
+		int64_t seen = 0;
+		for (int64_t i = 0; i < bucket_count; i++) {
+			seen += counts[i].load(std::memory_order_relaxed);
+			if (seen >= rank) { return std::min(bucket_upper_bound(i), max.load(std::memory_order_relaxed)); }
+		}
+		return max.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Prints the percentiles, e.g. "p50 1.2µs, p90 ...". Recorded values are converted to nanoseconds with to_ns.
+	 */
+	void print(std::ostream &output, int64_t (*to_ns)(int64_t) = identity_to_ns) const {
+		using TimeStampType = TimeStamp<>;
+		output << "p50 " << TimeStampType::to_string(to_ns(value_at_percentile(50))) << ", p90 "
+			   << TimeStampType::to_string(to_ns(value_at_percentile(90))) << ", p99 "
+			   << TimeStampType::to_string(to_ns(value_at_percentile(99))) << ", p99.9 "
+			   << TimeStampType::to_string(to_ns(value_at_percentile(99.9)));
+	}
+};
+
+/**
+ * Statistics of one code section call site. Durations are stored in raw clock ticks and converted when printing.
+ * Sampled call sites only record one in sample_interval calls, the call count and total are extrapolated when printing.
+ */
+struct CodeSectionStatistics {
+	const char *const name;
+	const int         line;
+	int64_t (*const to_ns)(int64_t);
+	const int64_t sample_interval;
+
+	std::atomic<int64_t> total{0};
+	LatencyHistogram<>   histogram{}; // count, min and max are tracked by the histogram
+#ifdef TIMER_CPU_TIME
+	std::atomic<int64_t> cpu_time{0}; // ns
+#endif
+#ifdef TIMER_PERF_COUNTERS
+	std::atomic<int64_t> counters[PerfCounters::count]{};
+#endif
+
+	CodeSectionStatistics(const char *name, int line, int64_t (*to_ns)(int64_t), int64_t sample_interval = 1)
+		: name(name), line(line), to_ns(to_ns), sample_interval(sample_interval) {}
+
+	void record(int64_t ticks) {
+		relaxed_add(total, ticks);
+		histogram.record(ticks);
+	}
+
+#ifdef TIMER_CPU_TIME
+	void record_cpu_time(int64_t ns) { relaxed_add(cpu_time, ns); }
+#endif
+
+#ifdef TIMER_PERF_COUNTERS
+	void record_counters(const PerfCounters::Values &difference) {
+		for (std::size_t i = 0; i < PerfCounters::count; i++) { relaxed_add(counters[i], difference[i]); }
+	}
+#endif
+
+	void reset() {
+		total.store(0, std::memory_order_relaxed);
+		histogram.reset();
+#ifdef TIMER_CPU_TIME
+		cpu_time.store(0, std::memory_order_relaxed);
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		for (auto &counter: counters) { counter.store(0, std::memory_order_relaxed); }
+#endif
+	}
+
+	void print(std::ostream &output) const {
+		using TimeStampType = TimeStamp<>;
+
+		const int64_t calls = histogram.count.load(std::memory_order_relaxed);
+		if (calls == 0) {
+			output << "\t" << name << ":" << line << " never called\n";
+			return;
+		}
+		const int64_t sum = total.load(std::memory_order_relaxed);
+		if (sample_interval == 1) {
+			output << "\t" << name << ":" << line << " called " << calls << " times, total "
+				   << TimeStampType::to_string(to_ns(sum));
+		} else {
+			output << "\t" << name << ":" << line << " called ~" << calls * sample_interval << " times (" << calls
+				   << " sampled, 1 in " << sample_interval << "), total ~"
+				   << TimeStampType::to_string(to_ns(sum) * sample_interval);
+		}
+		output << ", avg " << TimeStampType::to_string(to_ns(sum / calls))
+			   << ", min " << TimeStampType::to_string(to_ns(histogram.min.load(std::memory_order_relaxed)))
+			   << ", max " << TimeStampType::to_string(to_ns(histogram.max.load(std::memory_order_relaxed))) << ", ";
+		histogram.print(output, to_ns);
+#ifdef TIMER_CPU_TIME
+		const int64_t average_cpu_time = cpu_time.load(std::memory_order_relaxed) / calls;
+		output << ", avg CPU " << TimeStampType::to_string(average_cpu_time) << ", avg off-CPU "
+			   << TimeStampType::to_string(std::max(int64_t(0), to_ns(sum / calls) - average_cpu_time));
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		PerfCounters::Values totals{};
+		for (std::size_t i = 0; i < PerfCounters::count; i++) {
+			totals[i] = counters[i].load(std::memory_order_relaxed);
+		}
+		OutputBuffer<256> counter_output(output);
+		counter_output.append(", per call");
+		PerfCounters::append(counter_output, totals, calls);
+		counter_output.flush();
+#endif
+		output << "\n";
+	}
+};
+
+/**
+ * Call tree mode using "#define TIMER_SECTION_TREE".
+ * Every thread keeps a stack of its active aggregated code sections, so each section knows its parent.
+ * The calls are collected into a tree with inclusive time, exclusive time (without children) and call count per node,
+ * which CodeSectionRegistry prints as indented tree or as folded stacks for flamegraph.pl.
+ */
+struct CodeSectionNode {
+	const CodeSectionStatistics                  *site; // nullptr for the root
+	CodeSectionNode                              *parent;
+	std::vector<std::unique_ptr<CodeSectionNode>> children{};
+	int64_t                                       calls         = 0;
+	int64_t                                       inclusive     = 0; // raw clock ticks
+	int64_t                                       children_time = 0; // raw clock ticks spent in children
+
+	CodeSectionNode(const CodeSectionStatistics *site, CodeSectionNode *parent) : site(site), parent(parent) {}
+
+	[[nodiscard]] int64_t exclusive() const { return inclusive - children_time; }
+
+	CodeSectionNode &child(const CodeSectionStatistics *child_site) {
+		for (auto &existing: children) {
+			if (existing->site == child_site) { return *existing; }
+		}
+		return *children.emplace_back(std::make_unique<CodeSectionNode>(child_site, this));
+	}
+
+	void merge(const CodeSectionNode &other) {
+		calls += other.calls;
+		inclusive += other.inclusive;
+		children_time += other.children_time;
+		for (auto &other_child: other.children) { child(other_child->site).merge(*other_child); }
+	}
+
+	void reset() {
+		calls         = 0;
+		inclusive     = 0;
+		children_time = 0;
+		for (auto &existing: children) { existing->reset(); }
+	}
+
+	void print(std::ostream &output, int depth) const {
+		using TimeStampType = TimeStamp<>;
+		if (site != nullptr) {
+			output << std::string(std::size_t(depth), '\t') << site->name << ":" << site->line << " called " << calls
+				   << " times, inclusive " << TimeStampType::to_string(site->to_ns(inclusive)) << ", exclusive "
+				   << TimeStampType::to_string(site->to_ns(exclusive())) << "\n";
+		}
+		for (auto &existing: children) { existing->print(output, depth + 1); }
+	}
+
+	/*
+	 * One line per node: the names from the root separated by ';' and the exclusive time in nanoseconds.
+	 */
+	void print_folded(std::ostream &output, const std::string &stack) const {
+		std::string path = stack;
+		if (site != nullptr) {
+			if (!path.empty()) { path += ';'; }
+			for (const char c: std::string_view(site->name)) { path += c == ';' ? ',' : c; }
+			output << path << " " << site->to_ns(exclusive()) << "\n";
+		}
+		for (auto &existing: children) { existing->print_folded(output, path); }
+	}
+};
+
+/*
+ * The call tree of one thread. current is the innermost active section, enter() and leave() only touch this thread's
+ * nodes, so they need no synchronization.
+ */
+struct CodeSectionTree {
+	CodeSectionNode  root{nullptr, nullptr};
+	CodeSectionNode *current = &root;
+
+	void enter(const CodeSectionStatistics &site) { current = &current->child(&site); }
+
+	void leave(int64_t ticks) {
+		current->calls++;
+		current->inclusive += ticks;
+		current = current->parent;
+		current->children_time += ticks;
+	}
+};
+
+/**
+ * Owns the statistics of all aggregated code sections. Print the summary with CodeSectionRegistry::get().print().
+ * It is printed at exit as well, unless print_at_exit is set to false.
+ */
+struct CodeSectionRegistry {
+	std::atomic<Sink *>                                &sink = output_sink(); // constructed first, destroyed last
+	std::vector<std::unique_ptr<CodeSectionStatistics>> sites{};
+	std::vector<std::unique_ptr<CodeSectionTree>>       trees{}; // one per thread, see TIMER_SECTION_TREE
+	std::mutex                                          guard{};
+	bool                                                print_at_exit = true;
+
+	static CodeSectionRegistry &get() {
+		static CodeSectionRegistry registry;
+		return registry;
+	}
+
+	/*
+	 * The tree is owned by the registry, so it outlives the thread.
+	 */
+	static CodeSectionTree &this_thread_tree() {
+		thread_local CodeSectionTree *tree = get().add_tree();
+		return *tree;
+	}
+
+	CodeSectionTree *add_tree() {
+		std::lock_guard lock(guard);
+		return trees.emplace_back(std::make_unique<CodeSectionTree>()).get();
+	}
+
+	/**
+	 * The call trees of all threads merged into one. Like Timer::log(), this is meant to be called when the
+	 * measured threads are done.
+	 */
+	std::unique_ptr<CodeSectionNode> merged_tree() {
+		std::lock_guard lock(guard);
+		auto            merged = std::make_unique<CodeSectionNode>(nullptr, nullptr);
+		for (auto &tree: trees) { merged->merge(tree->root); }
+		return merged;
+	}
+
+	void print_tree() {
+		print_to_output_sink([&](std::ostream &output) { print_tree(output); });
+	}
+
+	void print_tree(std::ostream &output) {
+		output << "Code section tree :\n";
+		merged_tree()->print(output, 0);
+		output << std::flush;
+	}
+
+	/**
+	 * Prints the call tree as folded stacks, the input format of flamegraph.pl.
+	 */
+	void print_folded(std::ostream &output) { merged_tree()->print_folded(output, ""); }
+
+	/*
+	 * Called once per call site, through the function local static of CODE_SECTION_TIMER_AGGREGATED.
+	 * The same function and line may show up in several translation units, those share one record.
+	 */
+	template<class CLOCK = TIMER_DEFAULT_CLOCK>
+	CodeSectionStatistics &site(const char *name, int line, int64_t sample_interval = 1) {
+		std::lock_guard lock(guard);
+		for (auto &existing: sites) {
+			if (existing->line == line && std::string_view(existing->name) == name) { return *existing; }
+		}
+		const int64_t interval = std::max(int64_t(1), sample_interval);
+		return *sites.emplace_back(std::make_unique<CodeSectionStatistics>(name, line, &CLOCK::to_ns, interval));
+	}
+
+	void print() {
+		print_to_output_sink([&](std::ostream &output) { print(output); });
+	}
+
+	void print(std::ostream &output) {
+		std::lock_guard lock(guard);
+		output << "Code sections :\n";
+		for (auto &site: sites) { site->print(output); }
+		output << std::flush;
+	}
+
+	void reset() {
+		std::lock_guard lock(guard);
+		for (auto &site: sites) { site->reset(); }
+		for (auto &tree: trees) { tree->root.reset(); }
+	}
+
+	~CodeSectionRegistry() {
+		if (print_at_exit && !sites.empty()) { print(); }
+		if (print_at_exit && !trees.empty()) { print_tree(); }
+	}
+};
+
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct AggregatingCodeSectionTimer {
+	CodeSectionStatistics &statistics;
+#ifdef TIMER_SECTION_TREE
+	CodeSectionTree &tree = CodeSectionRegistry::this_thread_tree();
+#endif
+#ifdef TIMER_PERF_COUNTERS
+	PerfCounters::Values start_counters;
+#endif
+#ifdef TIMER_CPU_TIME
+	int64_t start_cpu_time;
+#endif
+	int64_t start;
+
+	explicit AggregatingCodeSectionTimer(CodeSectionStatistics &statistics) : statistics(statistics) {
+#ifdef TIMER_SECTION_TREE
+		tree.enter(statistics);
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		start_counters = PerfCounters::read();
+#endif
+#ifdef TIMER_CPU_TIME
+		start_cpu_time = get_thread_cpu_time_ns();
+#endif
+		start = CLOCK::now();
+	}
+	AggregatingCodeSectionTimer(AggregatingCodeSectionTimer &)  = delete;
+	AggregatingCodeSectionTimer(AggregatingCodeSectionTimer &&) = delete;
+	void operator=(AggregatingCodeSectionTimer &)               = delete;
+
+	~AggregatingCodeSectionTimer() {
+		const int64_t end      = CLOCK::now();
+		const int64_t duration = TimerOverhead<CLOCK>::subtract_code_section(end - start);
+		statistics.record(duration);
+#ifdef TIMER_CPU_TIME
+		statistics.record_cpu_time(
+				TimerOverhead<CLOCK>::subtract_code_section_cpu_time(get_thread_cpu_time_ns() - start_cpu_time));
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		statistics.record_counters(PerfCounters::difference(start_counters, PerfCounters::read()));
+#endif
+#ifdef TIMER_SECTION_TREE
+		tree.leave(duration);
+#endif
+		if (auto *writer = TraceEventWriter::code_section_writer().load(std::memory_order_acquire)) {
+			writer->complete_event(statistics.name, "section", TraceEventWriter::section_process,
+								   get_thread_index(), CLOCK::to_steady_ns(start),
+								   CLOCK::to_ns(end - start));
+		}
+	}
+};
+
+#define CODE_SECTION_TIMER_CONCATENATE(A, B) A##B
+#define CODE_SECTION_TIMER_CONCATENATE2(A, B) CODE_SECTION_TIMER_CONCATENATE(A, B)
+/**
+ * @brief Adds the time passed between the start and the end of the code section to the statistics of this call site.
+ * Nothing is printed per call, see CodeSectionRegistry.
+ */
+#define CODE_SECTION_TIMER_AGGREGATED                                                                                  \
+	static CodeSectionStatistics &CODE_SECTION_TIMER_CONCATENATE2(code_section_statistics_internal_do_not_touch,       \
+																  __LINE__) =                                          \
+			CodeSectionRegistry::get().site<TIMER_DEFAULT_CLOCK>(__PRETTY_FUNCTION__, __LINE__);                       \
+	const auto CODE_SECTION_TIMER_CONCATENATE2(code_section_timer_internal_do_not_touch, __LINE__) =                   \
+			AggregatingCodeSectionTimer<>(                                                                             \
+					CODE_SECTION_TIMER_CONCATENATE2(code_section_statistics_internal_do_not_touch, __LINE__))
+
+/**
+ * Decides which calls of a sampled code section are timed. Every thread has its own countdown per call site,
+ * so a call that is not timed costs a decrement and a well predicted branch.
+ * Randomized intervals are uniform in [1, 2 * interval - 1], which keeps the mean but avoids aliasing with periodic
+ * workloads.
+ */
+struct CodeSectionSampler {
+	const int64_t interval;
+	const bool    randomized;
+	uint64_t      random_state;
+	int64_t       countdown;
+
+	CodeSectionSampler(int64_t interval, bool randomized)
+		: interval(std::max(int64_t(1), interval)), randomized(randomized),
+		  random_state((0x9E3779B97F4A7C15u * (uint64_t(get_thread_index()) + 1)) ^ uint64_t(uintptr_t(this))),
+		  countdown(next_interval()) {}
+
+	bool sample() {
+		if (--countdown > 0) { return false; }
+		countdown = next_interval();
+		return true;
+	}
+
+	/*
+	 * xorshift64, good enough to spread the samples and costs nothing compared to timing a call.
+	 */
+	int64_t next_interval() {
+		if (!randomized || interval == 1) { return interval; }
+		random_state ^= random_state << 13;
+		random_state ^= random_state >> 7;
+		random_state ^= random_state << 17;
+		return 1 + int64_t(random_state % uint64_t(2 * interval - 1));
+	}
+};
+
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct SampledCodeSectionTimer {
+	std::optional<AggregatingCodeSectionTimer<CLOCK>> timer{};
+
+	SampledCodeSectionTimer(CodeSectionStatistics &statistics, CodeSectionSampler &sampler) {
+		if (sampler.sample()) { timer.emplace(statistics); }
+	}
+	SampledCodeSectionTimer(SampledCodeSectionTimer &)  = delete;
+	SampledCodeSectionTimer(SampledCodeSectionTimer &&) = delete;
+	void operator=(SampledCodeSectionTimer &)           = delete;
+};
+
+#define CODE_SECTION_TIMER_SAMPLED_INTERNAL(INTERVAL, RANDOMIZED)                                                      \
+	static CodeSectionStatistics &CODE_SECTION_TIMER_CONCATENATE2(code_section_statistics_internal_do_not_touch,       \
+																  __LINE__) =                                          \
+			CodeSectionRegistry::get().site<TIMER_DEFAULT_CLOCK>(__PRETTY_FUNCTION__, __LINE__, INTERVAL);             \
+	thread_local CodeSectionSampler CODE_SECTION_TIMER_CONCATENATE2(code_section_sampler_internal_do_not_touch,        \
+																	__LINE__)(INTERVAL, RANDOMIZED);                   \
+	const auto CODE_SECTION_TIMER_CONCATENATE2(code_section_timer_internal_do_not_touch, __LINE__) =                   \
+			SampledCodeSectionTimer<>(CODE_SECTION_TIMER_CONCATENATE2(code_section_statistics_internal_do_not_touch,   \
+																	  __LINE__),                                       \
+									  CODE_SECTION_TIMER_CONCATENATE2(code_section_sampler_internal_do_not_touch,      \
+																	  __LINE__))
+
+/**
+ * @brief Like CODE_SECTION_TIMER_AGGREGATED, but only times one in INTERVAL calls of each thread.
+ * For call sites which run millions of times. The report extrapolates the call count and the total time,
+ * the call tree (TIMER_SECTION_TREE) only contains the timed calls.
+ */
+#define CODE_SECTION_TIMER_SAMPLED(INTERVAL) CODE_SECTION_TIMER_SAMPLED_INTERNAL(INTERVAL, false)
+
+/**
+ * @brief Like CODE_SECTION_TIMER_SAMPLED, but with random intervals of INTERVAL calls on average.
+ */
+#define CODE_SECTION_TIMER_SAMPLED_RANDOMIZED(INTERVAL) CODE_SECTION_TIMER_SAMPLED_INTERNAL(INTERVAL, true)
+
+/**
+ * Aggregating mode using "#define TIMER_AGGREGATE_SECTIONS".
+ * CODE_SECTION_TIMER then behaves like CODE_SECTION_TIMER_AGGREGATED, so hot functions don't flood the output.
+ */
+#ifdef TIMER_AGGREGATE_SECTIONS
+#define CODE_SECTION_TIMER CODE_SECTION_TIMER_AGGREGATED
+#else
+/**
+ * @brief Prints the time passed between the start and the end of the code section.
+ */
+#define CODE_SECTION_TIMER                                                                                             \
+	const auto CODE_SECTION_TIMER_CONCATENATE2(code_section_timer_internal_do_not_touch, __LINE__) =                   \
+			CodeSectionTimer<>(__PRETTY_FUNCTION__)
+#endif
+
+/**
+ * Fixed capacity ring of events. Once it is full, every new event overwrites the oldest one.
+ * All memory is allocated up front, so adding an event never allocates. Index 0 is the oldest retained event.
+ */
+template<class T, std::size_t CAPACITY>
+struct RingBuffer {
+	static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "The capacity must be a power of two");
+	static constexpr std::size_t mask = CAPACITY - 1;
+
+	struct alignas(T) Slot {
+		unsigned char bytes[sizeof(T)];
+	};
+
+	std::unique_ptr<Slot[]> slots   = std::make_unique<Slot[]>(CAPACITY);
+	uint64_t                written = 0; // number of events ever added
+
+	RingBuffer()                       = default;
+	RingBuffer(const RingBuffer &)     = delete;
+	void operator=(const RingBuffer &) = delete;
+	~RingBuffer() { clear(); }
+
+	template<class... ARGS>
+	T &emplace_back(ARGS &&...args) {
+		Slot &slot = slots[written & mask];
+		if (written >= CAPACITY) { get(slot).~T(); }
+		T *result = new (slot.bytes) T(std::forward<ARGS>(args)...);
+		written++;
+		return *result;
+	}
+
+	[[nodiscard]] std::size_t size() const { return written < CAPACITY ? std::size_t(written) : CAPACITY; }
+
+	[[nodiscard]] bool empty() const { return written == 0; }
+
+	/**
+	 * @return The number of events which were overwritten.
+	 */
+	[[nodiscard]] uint64_t dropped() const { return written - size(); }
+
+	const T &operator[](std::size_t index) const { return get(slots[(written - size() + index) & mask]); }
+
+	const T &front() const { return (*this)[0]; }
+
+	const T &back() const { return (*this)[size() - 1]; }
+
+	void clear() {
+		for (std::size_t i = 0; i < size(); i++) { get(slots[(written - size() + i) & mask]).~T(); }
+		written = 0;
+	}
+
+private:
+	static T &get(Slot &slot) { return *std::launder(reinterpret_cast<T *>(slot.bytes)); }
+
+	static const T &get(const Slot &slot) { return *std::launder(reinterpret_cast<const T *>(slot.bytes)); }
+};
+
+template<class T, class ALLOCATOR>
+uint64_t dropped_events(const std::vector<T, ALLOCATOR> &) {
+	return 0;
+}
+
+template<class T, std::size_t CAPACITY>
+uint64_t dropped_events(const RingBuffer<T, CAPACITY> &events) {
+	return events.dropped();
+}
+
+/*
+ * Whether the dropped events of a container are its oldest events, which were overwritten, or events which did not fit.
+ */
+template<class CONTAINER>
+inline constexpr bool overwrites_oldest_events = false;
+
+template<class T, std::size_t CAPACITY>
+inline constexpr bool overwrites_oldest_events<RingBuffer<T, CAPACITY>> = true;
+
+/**
+ * Events in chunks of CHUNK events, which are never moved once allocated. When a chunk is full the next one is
+ * allocated, so adding an event never copies earlier events. Its worst case is allocating one chunk without writing to
+ * it, or none if the chunks were reserved up front. clear() keeps the chunks for reuse. Index 0 is the oldest event.
+ */
+template<class T, std::size_t CHUNK>
+struct ChunkedBuffer {
+	static_assert(CHUNK > 0 && (CHUNK & (CHUNK - 1)) == 0, "The chunk size must be a power of two");
+
+	struct alignas(T) Slot {
+		unsigned char bytes[sizeof(T)];
+	};
+
+	std::vector<std::unique_ptr<Slot[]>> chunks{}; // only holds pointers, so growing it is cheap
+	std::size_t                          count = 0;
+
+	ChunkedBuffer()                       = default;
+	ChunkedBuffer(const ChunkedBuffer &)  = delete;
+	void operator=(const ChunkedBuffer &) = delete;
+	~ChunkedBuffer() { clear(); }
+
+	template<class... ARGS>
+	T &emplace_back(ARGS &&...args) {
+		if (count == chunks.size() * CHUNK) { add_chunk(); }
+		T *result = new (chunks[count / CHUNK][count % CHUNK].bytes) T(std::forward<ARGS>(args)...);
+		count++;
+		return *result;
+	}
+
+	/**
+	 * Allocates the chunks for at least capacity events, so adding them never allocates.
+	 * The memory is written once, which also takes the page faults out of the measurement.
+	 */
+	void reserve(std::size_t capacity) {
+		chunks.reserve((capacity + CHUNK - 1) / CHUNK);
+		while (chunks.size() * CHUNK < capacity) {
+			add_chunk();
+			std::memset(chunks.back().get(), 0, CHUNK * sizeof(Slot));
+		}
+	}
+
+	[[nodiscard]] std::size_t size() const { return count; }
+
+	[[nodiscard]] bool empty() const { return count == 0; }
+
+	const T &operator[](std::size_t index) const { return get(chunks[index / CHUNK][index % CHUNK]); }
+
+	const T &front() const { return (*this)[0]; }
+
+	const T &back() const { return (*this)[count - 1]; }
+
+	void clear() {
+		for (std::size_t i = 0; i < count; i++) { get(chunks[i / CHUNK][i % CHUNK]).~T(); }
+		count = 0;
+	}
+
+private:
+	/*
+	 * Default initialized, so emplace_back() doesn't fill a whole chunk with zeros.
+	 */
+	void add_chunk() { chunks.push_back(std::unique_ptr<Slot[]>(new Slot[CHUNK])); }
+
+	static T &get(Slot &slot) { return *std::launder(reinterpret_cast<T *>(slot.bytes)); }
+
+	static const T &get(const Slot &slot) { return *std::launder(reinterpret_cast<const T *>(slot.bytes)); }
+};
+
+template<class T, std::size_t CHUNK>
+uint64_t dropped_events(const ChunkedBuffer<T, CHUNK> &) {
+	return 0;
+}
+
+/*
+ * Reserving events up front and checking that adding one doesn't allocate, see Timer::reserve().
+ */
+template<class T, class ALLOCATOR>
+void reserve_events(std::vector<T, ALLOCATOR> &events, std::size_t capacity) {
+	events.reserve(capacity);
+}
+
+template<class T, std::size_t CAPACITY>
+void reserve_events(RingBuffer<T, CAPACITY> &, std::size_t) { /* allocated up front anyway */
+}
+
+template<class T, std::size_t CHUNK>
+void reserve_events(ChunkedBuffer<T, CHUNK> &events, std::size_t capacity) {
+	events.reserve(capacity);
+}
+
+template<class T, class ALLOCATOR>
+bool will_allocate(const std::vector<T, ALLOCATOR> &events) {
+	return events.size() == events.capacity();
+}
+
+template<class T, std::size_t CAPACITY>
+bool will_allocate(const RingBuffer<T, CAPACITY> &) {
+	return false;
+}
+
+template<class T, std::size_t CHUNK>
+bool will_allocate(const ChunkedBuffer<T, CHUNK> &events) {
+	return events.size() == events.chunks.size() * CHUNK;
+}
+
+/**
+ * The file format of MappedFileBuffer: this header, followed by count records of record_size bytes, followed by the
+ * name table if names_offset is not 0. A record is the raw bytes of a TimeStamp: the name at offset 0, the uint16
+ * thread index at thread_offset and the time stamp in raw clock ticks at time_offset, multiply by ns_per_tick.
+ * The name table is written when the file is closed: a uint64 count, then for every name a uint64 key (the address
+ * of a const char * name or the id of an EventName), a uint32 length and the text.
+ */
+struct MappedFileHeader {
+	static constexpr uint64_t magic_value   = 0x474F4C52454D4954; // "TIMERLOG" in little endian
+	static constexpr uint32_t version_value = 2;
+	static constexpr uint16_t no_thread     = 0xffff; // thread_offset without TIMER_THREADS
+
+	enum NameKind : uint16_t {
+		signed_names,   // integral names
+		unsigned_names, // unsigned integral names
+		table_names,    // looked up in the name table
+		raw_names,      // other trivially copyable names, shown as bytes
+	};
+
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t count; // records written completely, updated after each record
+	double   ns_per_tick;
+	uint64_t names_offset;
+	uint16_t name_size;
+	uint16_t name_kind;
+	uint16_t thread_offset;
+	uint16_t time_offset;
+	uint8_t  reserved[16];
+};
+static_assert(sizeof(MappedFileHeader) == 64, "Records start at a cache line");
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Events appended to a memory mapped file, which grows with ftruncate() and mremap() (Linux only).
+ * The kernel writes the pages back, so the events of hours of traffic don't have to fit into memory, and all events
+ * written before a crash of the process are in the file. Reading an event reads the mapping, nothing is copied.
+ * Records are written as they are, so the event type must be trivially copyable, e.g. Timer<int>, Timer<EventName> or
+ * Timer<const char *>. The texts of EventName and const char * names are added to the file when it is closed, so like
+ * for log() const char * names have to stay valid until then. Read the file with MappedFileReader or ./trace_dump.
+ * Without a file name, or if the file can't be created (an error is printed), the events are kept in anonymous memory.
+ * If the file can't grow any more, recording stops and the events which don't fit are counted as dropped.
+ */
+template<class T>
+struct MappedFileBuffer {
+	static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable events can be written to a file");
+	static_assert(std::is_standard_layout_v<T>, "The header describes the layout of the records with offsetof");
+	using NAME_TYPE = std::remove_const_t<decltype(T::name)>;
+
+	static constexpr std::size_t header_size      = sizeof(MappedFileHeader);
+	static constexpr std::size_t initial_capacity = 4096;
+
+	int               fd       = -1;
+	unsigned char    *mapping  = nullptr;
+	std::size_t       capacity = 0; // records
+	MappedFileHeader  unmapped_header{};
+	MappedFileHeader *header  = &unmapped_header; // the start of the mapping, once there is one
+	uint64_t          dropped = 0;                // events which did not fit, see full
+	bool              full    = false;            // set when growing failed, nothing is recorded after that
+
+	alignas(T) unsigned char overflow[sizeof(T)]; // where the events are built which are dropped
+
+	explicit MappedFileBuffer(const std::string &file_name) {
+		if (!file_name.empty()) {
+			fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0) {
+				std::cerr << "MappedFileBuffer: can't open \"" << file_name << "\", using memory" << std::endl;
+			}
+		}
+		if (!resize(initial_capacity) && fd >= 0) {
+			close(fd);
+			fd = -1;
+			std::cerr << "MappedFileBuffer: using memory instead of \"" << file_name << "\"" << std::endl;
+			full = !resize(initial_capacity);
+		}
+		header->magic       = MappedFileHeader::magic_value;
+		header->version     = MappedFileHeader::version_value;
+		header->record_size = uint32_t(sizeof(T));
+		header->count       = 0;
+		header->ns_per_tick = double(T::CLOCK_TYPE::to_ns(1'000'000'000)) / 1e9;
+		header->name_size   = uint16_t(sizeof(NAME_TYPE));
+		header->name_kind   = name_kind();
+#ifdef TIMER_THREADS
+		header->thread_offset = uint16_t(offsetof(T, thread_index));
+#else
+		header->thread_offset = MappedFileHeader::no_thread;
+#endif
+		header->time_offset = uint16_t(offsetof(T, time_stamp));
+	}
+	MappedFileBuffer(const MappedFileBuffer &) = delete;
+	void operator=(const MappedFileBuffer &)   = delete;
+
+	/*
+	 * Cuts the file to the records which were written and appends the name table.
+	 */
+	~MappedFileBuffer() {
+		const std::size_t used  = header_size + header->count * sizeof(T);
+		const std::string names = fd >= 0 ? name_table() : std::string();
+		if (!names.empty()) { header->names_offset = used; }
+		if (mapping != nullptr) { munmap(mapping, header_size + capacity * sizeof(T)); }
+		if (fd >= 0) {
+			if (ftruncate(fd, off_t(used)) != 0) {
+				std::cerr << "MappedFileBuffer: can't truncate the file" << std::endl;
+			}
+			if (!names.empty() && pwrite(fd, names.data(), names.size(), off_t(used)) != ssize_t(names.size())) {
+				std::cerr << "MappedFileBuffer: can't write the name table" << std::endl;
+			}
+			close(fd);
+		}
+	}
+
+	template<class... ARGS>
+	T &emplace_back(ARGS &&...args) {
+		if (header->count == capacity && (full || !resize(std::max(capacity * 2, initial_capacity)))) {
+			full = true;
+			dropped++;
+			return *new (overflow) T(std::forward<ARGS>(args)...);
+		}
+		T *result = new (mapping + header_size + header->count * sizeof(T)) T(std::forward<ARGS>(args)...);
+		header->count++;
+		return *result;
+	}
+
+	/*
+	 * If the file can't grow, the events are recorded until it is full as usual.
+	 */
+	void reserve(std::size_t records) {
+		if (records > capacity && !full) { resize(records); }
+	}
+
+	[[nodiscard]] std::size_t size() const { return std::size_t(header->count); }
+
+	[[nodiscard]] bool empty() const { return header->count == 0; }
+
+	const T &operator[](std::size_t index) const {
+		return *std::launder(reinterpret_cast<const T *>(mapping + header_size + index * sizeof(T)));
+	}
+
+	const T &front() const { return (*this)[0]; }
+
+	const T &back() const { return (*this)[size() - 1]; }
+
+	void clear() {
+		header->count = 0;
+		dropped       = 0;
+		full          = false;
+	}
+
+private:
+	static constexpr uint16_t name_kind() {
+		if constexpr (std::is_same_v<NAME_TYPE, const char *> || std::is_same_v<NAME_TYPE, EventName>) {
+			return MappedFileHeader::table_names;
+		} else if constexpr (std::is_integral_v<NAME_TYPE>) {
+			return std::is_signed_v<NAME_TYPE> ? MappedFileHeader::signed_names : MappedFileHeader::unsigned_names;
+		} else {
+			return MappedFileHeader::raw_names;
+		}
+	}
+
+	/*
+	 * The texts of EventName and const char * names, see MappedFileHeader. Empty for other names.
+	 */
+	[[nodiscard]] std::string name_table() const {
+		std::vector<std::pair<uint64_t, std::string_view>> entries;
+		if constexpr (std::is_same_v<NAME_TYPE, EventName>) {
+			const auto names = NameTable::get().snapshot();
+			for (std::size_t id = 0; id < names.size(); id++) { entries.emplace_back(id, names[id]); }
+		} else if constexpr (std::is_same_v<NAME_TYPE, const char *>) {
+			std::unordered_map<const char *, bool> seen;
+			for (std::size_t i = 0; i < size(); i++) {
+				const char *name = (*this)[i].name;
+				if (seen.try_emplace(name, true).second) {
+					entries.emplace_back(uint64_t(uintptr_t(name)), name == nullptr ? "" : name);
+				}
+			}
+		}
+		std::string table;
+		if (entries.empty()) { return table; }
+		const auto append = [&](const auto &value) {
+			table.append(reinterpret_cast<const char *>(&value), sizeof(value));
+		};
+		append(uint64_t(entries.size()));
+		for (const auto &[key, text]: entries) {
+			append(key);
+			append(uint32_t(text.size()));
+			table.append(text);
+		}
+		return table;
+	}
+
+	/*
+	 * Grows the file and the mapping. mremap() may move the mapping, like a std::vector it invalidates references.
+	 */
+	bool resize(std::size_t records) {
+		const std::size_t length = header_size + records * sizeof(T);
+		if (fd >= 0 && ftruncate(fd, off_t(length)) != 0) {
+			std::cerr << "MappedFileBuffer: can't grow the file" << std::endl;
+			return false;
+		}
+		void *result;
+		if (mapping == nullptr) {
+			result = fd >= 0 ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+							 : mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		} else {
+			result = mremap(mapping, header_size + capacity * sizeof(T), length, MREMAP_MAYMOVE);
+		}
+		if (result == MAP_FAILED) {
+			std::cerr << "MappedFileBuffer: can't map " << length << " bytes" << std::endl;
+			return false;
+		}
+		if (mapping == nullptr) { std::memcpy(result, &unmapped_header, sizeof(unmapped_header)); }
+		mapping  = static_cast<unsigned char *>(result);
+		header   = reinterpret_cast<MappedFileHeader *>(mapping);
+		capacity = records;
+		return true;
+	}
+};
+
+template<class T>
+uint64_t dropped_events(const MappedFileBuffer<T> &events) {
+	return events.dropped;
+}
+
+template<class T>
+void reserve_events(MappedFileBuffer<T> &events, std::size_t capacity) {
+	events.reserve(capacity);
+}
+
+template<class T>
+bool will_allocate(const MappedFileBuffer<T> &events) {
+	return events.size() == events.capacity;
+}
+#endif
+
+/**
+ * Reads a file of MappedFileStorage, on any platform. It yields the same events as BinaryTraceReader, so ./trace_dump
+ * reads both. Threads are the thread indices of the process. After a crash the file has no name table, then
+ * EventName and const char * names are shown as their id or address.
+ */
+struct MappedFileReader {
+	using Event = BinaryTraceReader::Event;
+
+	MappedFileHeader         header{};
+	std::vector<std::string> names{}; // filled while iterating
+	std::string              data{};
+	uint64_t                 count = 0;
+	bool                     valid = false;
+
+	explicit MappedFileReader(const char *path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) {
+			std::cerr << "MappedFileReader: can not open " << path << std::endl;
+			return;
+		}
+		data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		if (data.size() < sizeof(header)) {
+			std::cerr << "MappedFileReader: " << path << " is too short" << std::endl;
+			return;
+		}
+		std::memcpy(&header, data.data(), sizeof(header));
+		if (header.magic != MappedFileHeader::magic_value || header.version != MappedFileHeader::version_value ||
+			header.name_size > 8 || header.record_size < header.name_size ||
+			header.time_offset + sizeof(int64_t) > header.record_size ||
+			(header.thread_offset != MappedFileHeader::no_thread &&
+			 header.thread_offset + sizeof(uint16_t) > header.record_size)) {
+			std::cerr << "MappedFileReader: " << path << " is not an event log of this version" << std::endl;
+			return;
+		}
+		const std::size_t records_end =
+				header.names_offset != 0 ? std::min<std::size_t>(header.names_offset, data.size()) : data.size();
+		count = std::min<uint64_t>(header.count, (records_end - sizeof(header)) / header.record_size);
+		if (header.names_offset != 0 && !read_name_table()) {
+			std::cerr << "MappedFileReader: the name table of " << path << " is damaged" << std::endl;
+		}
+		valid = true;
+	}
+
+	[[nodiscard]] bool is_open() const { return valid; }
+
+	[[nodiscard]] int64_t to_ns(int64_t ticks) const { return int64_t(double(ticks) * header.ns_per_tick); }
+
+	/**
+	 * Calls function(const Event &) for every event and returns the number of events.
+	 */
+	template<class FUNCTION>
+	uint64_t for_each(FUNCTION &&function) {
+		names.clear();
+		std::unordered_map<uint64_t, uint32_t> indices;
+		for (uint64_t i = 0; valid && i < count; i++) {
+			const char *record = data.data() + sizeof(header) + i * header.record_size;
+			uint64_t    key    = 0;
+			std::memcpy(&key, record, header.name_size);
+			const auto [entry, inserted] = indices.try_emplace(key, uint32_t(names.size()));
+			if (inserted) { names.push_back(name_text(key)); }
+
+			uint16_t thread = 0;
+			if (header.thread_offset != MappedFileHeader::no_thread) {
+				std::memcpy(&thread, record + header.thread_offset, sizeof(thread));
+			}
+			Event event{entry->second, thread, 0};
+			std::memcpy(&event.ticks, record + header.time_offset, sizeof(event.ticks));
+			function(static_cast<const Event &>(event));
+		}
+		return valid ? count : 0;
+	}
+
+private:
+	std::unordered_map<uint64_t, std::string> table{};
+
+	bool read_name_table() {
+		const auto read = [&](std::size_t &position, void *value, std::size_t size) {
+			if (data.size() - position < size) { return false; }
+			std::memcpy(value, data.data() + position, size);
+			position += size;
+			return true;
+		};
+		std::size_t position = std::size_t(header.names_offset);
+		uint64_t    entries;
+		if (position > data.size() || !read(position, &entries, sizeof(entries))) { return false; }
+		for (uint64_t i = 0; i < entries; i++) {
+			uint64_t key;
+			uint32_t length;
+			if (!read(position, &key, sizeof(key)) || !read(position, &length, sizeof(length)) ||
+				data.size() - position < length) {
+				return false;
+			}
+			table.emplace(key, data.substr(position, length));
+			position += length;
+		}
+		return true;
+	}
+
+	[[nodiscard]] std::string name_text(uint64_t key) const {
+		switch (header.name_kind) {
+			case MappedFileHeader::signed_names: {
+				const int shift = 64 - 8 * header.name_size;
+				return std::to_string(shift == 64 ? 0 : int64_t(key << shift) >> shift);
+			}
+			case MappedFileHeader::unsigned_names:
+				return std::to_string(key);
+			case MappedFileHeader::table_names:
+				if (const auto found = table.find(key); found != table.end()) { return found->second; }
+				[[fallthrough]];
+			default: {
+				std::ostringstream text;
+				text << "#" << std::hex << key;
+				return text.str();
+			}
+		}
+	}
+};
+
+/*
+ * Containers which take a std::pmr::memory_resource or a file name get it, the others ignore both.
+ */
+template<class CONTAINER>
+CONTAINER make_container([[maybe_unused]] std::pmr::memory_resource *resource,
+						 [[maybe_unused]] const std::string         &file_name) {
+	if constexpr (std::is_constructible_v<CONTAINER, std::pmr::memory_resource *>) {
+		return CONTAINER(resource);
+	} else if constexpr (std::is_constructible_v<CONTAINER, const std::string &>) {
+		return CONTAINER(file_name);
+	} else {
+		return CONTAINER();
+	}
+}
+
+/**
+ * Storage policies choose the container which holds the events of a Timer.
+ * VectorStorage keeps all events in a growing std::vector.
+ */
+struct VectorStorage {
+	template<class TIME_STAMP_TYPE>
+	using Container = std::vector<TIME_STAMP_TYPE>;
+};
+
+/**
+ * Flight recorder mode: keeps the last CAPACITY events in a preallocated RingBuffer.
+ * Memory stays constant and adding events never allocates. log() prints the retained window,
+ * the oldest retained event becomes the reference point.
+ */
+template<std::size_t CAPACITY>
+struct RingStorage {
+	template<class TIME_STAMP_TYPE>
+	using Container = RingBuffer<TIME_STAMP_TYPE, CAPACITY>;
+};
+
+/**
+ * Keeps all events in a ChunkedBuffer. Unlike VectorStorage, no add() ever copies the whole history,
+ * which bounds the worst case latency of add() (and the time the lock is held).
+ */
+template<std::size_t CHUNK = 4096>
+struct SegmentedStorage {
+	template<class TIME_STAMP_TYPE>
+	using Container = ChunkedBuffer<TIME_STAMP_TYPE, CHUNK>;
+};
+
+/**
+ * Allocates the events from the memory resource passed to the Timer constructor, e.g. a
+ * std::pmr::monotonic_buffer_resource over an arena, so a real-time thread never calls malloc.
+ * With TIMER_THREAD_LOCAL_BUFFERS all thread buffers allocate from the same resource, so an add() which grows its
+ * buffer takes the timer's lock, like reserve(). Reserve enough events per thread to keep add() lock free.
+ */
+struct PmrStorage {
+	template<class TIME_STAMP_TYPE>
+	using Container = std::pmr::vector<TIME_STAMP_TYPE>;
+};
+
+#ifdef __linux__
+/**
+ * Appends the events to the memory mapped file passed to the Timer constructor, see MappedFileBuffer.
+ * With TIMER_THREAD_LOCAL_BUFFERS every thread writes its own file, the thread name is appended to the file name.
+ */
+struct MappedFileStorage {
+	template<class TIME_STAMP_TYPE>
+	using Container = MappedFileBuffer<TIME_STAMP_TYPE>;
+};
+#endif
+
+/**
+ * Latency budgets: CODE_SECTION_TIMER_BUDGET(500us) only records the calls which take longer than the budget.
+ * A call within its budget reads the clock twice and compares, it doesn't write to any shared memory.
+ * Violations are counted per call site, and the last violation_capacity violations are kept with duration, start time
+ * and thread. Print them with BudgetRegistry::get().print(), at exit they are printed unless print_at_exit is false.
+ */
+struct BudgetSite {
+	const char *const name;
+	const int         line;
+	const int64_t     budget_ns;
+	const int64_t     budget_ticks; // compared against raw clock ticks, so the fast path doesn't convert
+	/*
+	 * Written by every violating thread, so it gets its own cache line and the fast path only reads a line which
+	 * nobody writes.
+	 */
+	alignas(64) std::atomic<int64_t> violations{0};
+
+	BudgetSite(const char *name, int line, int64_t budget_ns, int64_t budget_ticks)
+		: name(name), line(line), budget_ns(budget_ns), budget_ticks(budget_ticks) {}
+};
+
+struct BudgetViolation {
+	const BudgetSite *site;
+	int64_t           duration_ns;
+	int64_t           start_ns; // steady clock
+	uint16_t          thread_index;
+};
+
+struct BudgetRegistry {
+	static constexpr std::size_t violation_capacity = 1024;
+
+	std::atomic<Sink *>                            &sink = output_sink(); // constructed first, destroyed last
+	std::vector<std::unique_ptr<BudgetSite>>        sites{};
+	RingBuffer<BudgetViolation, violation_capacity> violations{};
+	std::mutex                                      guard{};
+	const int64_t                                   start_ns      = get_time_ns();
+	bool                                            print_at_exit = true;
+
+	static BudgetRegistry &get() {
+		static BudgetRegistry registry;
+		return registry;
+	}
+
+	/*
+	 * Called once per call site, through the function local static of CODE_SECTION_TIMER_BUDGET.
+	 */
+	template<class CLOCK = TIMER_DEFAULT_CLOCK>
+	BudgetSite &site(const char *name, int line, std::chrono::nanoseconds budget) {
+		constexpr int64_t second       = 1'000'000'000;
+		const int64_t     budget_ticks = int64_t(double(budget.count()) * second / double(CLOCK::to_ns(second)));
+		std::lock_guard   lock(guard);
+		for (auto &existing: sites) {
+			if (existing->line == line && std::string_view(existing->name) == name) { return *existing; }
+		}
+		return *sites.emplace_back(std::make_unique<BudgetSite>(name, line, budget.count(), budget_ticks));
+	}
+
+	/*
+	 * The slow path, only taken by violations.
+	 */
+	void record(BudgetSite &site, int64_t duration_ns, int64_t call_start_ns) {
+		relaxed_add(site.violations, 1);
+		{
+			std::lock_guard lock(guard);
+			violations.emplace_back(BudgetViolation{&site, duration_ns, call_start_ns, get_thread_index()});
+		}
+		if (auto *writer = TraceEventWriter::code_section_writer().load(std::memory_order_acquire)) {
+			writer->complete_event(site.name, "budget", TraceEventWriter::section_process, get_thread_index(),
+								   call_start_ns, duration_ns);
+		}
+	}
+
+	void print() {
+		print_to_output_sink([&](std::ostream &output) { print(output); });
+	}
+
+	void print(std::ostream &output) {
+		using TimeStampType = TimeStamp<>;
+
+		std::lock_guard lock(guard);
+		output << "Budget violations :\n";
+		for (auto &site: sites) {
+			output << "\t" << site->name << ":" << site->line << " budget " << TimeStampType::to_string(site->budget_ns)
+				   << ", " << site->violations.load(std::memory_order_relaxed) << " violations\n";
+		}
+		if (violations.dropped() != 0) {
+			output << "\t(" << violations.dropped() << " older violations overwritten)\n";
+		}
+		for (std::size_t i = 0; i < violations.size(); i++) {
+			const BudgetViolation &violation = violations[i];
+			output << "\t" << violation.site->name << ":" << violation.site->line << " took "
+				   << TimeStampType::to_string(violation.duration_ns) << " at "
+				   << TimeStampType::to_string(violation.start_ns - start_ns) << " in thread : "
+				   << violation.thread_index << "\n";
+		}
+		output << std::flush;
+	}
+
+	void reset() {
+		std::lock_guard lock(guard);
+		for (auto &site: sites) { site->violations.store(0, std::memory_order_relaxed); }
+		violations.clear();
+	}
+
+	~BudgetRegistry() {
+		if (print_at_exit && !violations.empty()) { print(); }
+	}
+};
+
+template<class CLOCK = TIMER_DEFAULT_CLOCK>
+struct BudgetCodeSectionTimer {
+	BudgetSite   &site;
+	const int64_t start = CLOCK::now();
+
+	explicit BudgetCodeSectionTimer(BudgetSite &site) : site(site) {}
+	BudgetCodeSectionTimer(BudgetCodeSectionTimer &)  = delete;
+	BudgetCodeSectionTimer(BudgetCodeSectionTimer &&) = delete;
+	void operator=(BudgetCodeSectionTimer &)          = delete;
+
+	~BudgetCodeSectionTimer() {
+		const int64_t duration = TimerOverhead<CLOCK>::subtract_code_section(CLOCK::now() - start);
+		if (duration > site.budget_ticks) {
+			BudgetRegistry::get().record(site, CLOCK::to_ns(duration), CLOCK::to_steady_ns(start));
+		}
+	}
+};
+
+/**
+ * @brief Records the calls of the code section which take longer than BUDGET, e.g. CODE_SECTION_TIMER_BUDGET(500us).
+ * BUDGET is a std::chrono duration, the std::chrono literals are available in it.
+ */
+#define CODE_SECTION_TIMER_BUDGET(BUDGET)                                                                              \
+	static BudgetSite &CODE_SECTION_TIMER_CONCATENATE2(code_section_budget_internal_do_not_touch, __LINE__) =          \
+			BudgetRegistry::get().site<TIMER_DEFAULT_CLOCK>(__PRETTY_FUNCTION__, __LINE__, [] {                        \
+				using namespace std::chrono_literals;                                                                  \
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(BUDGET);                                   \
+			}());                                                                                                      \
+	const auto CODE_SECTION_TIMER_CONCATENATE2(code_section_timer_internal_do_not_touch, __LINE__) =                   \
+			BudgetCodeSectionTimer<>(                                                                                  \
+					CODE_SECTION_TIMER_CONCATENATE2(code_section_budget_internal_do_not_touch, __LINE__))
+
+/**
+ * Statistics of the iterations of a loop, without storing an event per iteration. Get one with Timer::loop("name")
+ * right before the loop and call next() at the end of every iteration. An iteration costs one clock read and updates
+ * count, min, max, mean and variance (Welford's algorithm) and a histogram. Durations are kept in raw clock ticks.
+ * A loop section is used by one thread at a time. Timer::log() prints one line per loop.
+ */
+template<class NAME_TYPE = int, class CLOCK = TIMER_DEFAULT_CLOCK>
+struct LoopSection {
+	const NAME_TYPE    name;
+	int64_t            last                 = CLOCK::now(); // end of the previous iteration
+	int64_t            iterations           = 0;
+	int64_t            total                = 0;
+	double             mean                 = 0;
+	double             squared_distance_sum = 0; // variance * iterations
+	LatencyHistogram<> histogram{};
+
+	explicit LoopSection(NAME_TYPE name) : name(name) {}
+
+	/**
+	 * Ends the current iteration and starts the next one.
+	 */
+	void next() {
+		const int64_t now      = CLOCK::now();
+		const int64_t duration = now - last;
+		last                   = now;
+		iterations++;
+		total += duration;
+		const double delta = double(duration) - mean;
+		mean += delta / double(iterations);
+		squared_distance_sum += delta * (double(duration) - mean);
+		histogram.record_unshared(duration);
+	}
+
+	/**
+	 * Starts the next iteration now, e.g. when the loop is entered again after other work.
+	 */
+	void restart() { last = CLOCK::now(); }
+
+	[[nodiscard]] double variance() const { return iterations == 0 ? 0 : squared_distance_sum / double(iterations); }
+
+	template<std::size_t CAPACITY>
+	void append(OutputBuffer<CAPACITY> &output) const {
+		output.append("\tloop ");
+		output.append_name(name);
+		output.append(" : ");
+		output.append_integer(iterations);
+		output.append(" iterations");
+		if (iterations == 0) { return; }
+		output.append(", total ");
+		output.append_duration(CLOCK::to_ns(total));
+		output.append(", mean ");
+		output.append_duration(CLOCK::to_ns(int64_t(mean)));
+		output.append(", stddev ");
+		output.append_duration(CLOCK::to_ns(int64_t(std::sqrt(variance()))));
+		output.append(", min ");
+		output.append_duration(CLOCK::to_ns(histogram.min.load(std::memory_order_relaxed)));
+		output.append(", max ");
+		output.append_duration(CLOCK::to_ns(histogram.max.load(std::memory_order_relaxed)));
+		for (const double percentile: {50.0, 90.0, 99.0, 99.9}) {
+			output.append(", p");
+			output.append_number(percentile, 3);
+			output.append(' ');
+			output.append_duration(CLOCK::to_ns(histogram.value_at_percentile(percentile)));
+		}
+	}
+};
+
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+/*
+ * Every Timer gets a new instance number on construction and on reset.
+ * The per thread buffer caches are keyed by it, so they never hand out a buffer of a destroyed or reset timer.
+ */
+inline uint64_t next_timer_instance() {
+	static std::atomic<uint64_t> counter{0};
+	return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+#endif
+
+/**
+ * Timer class holds information on a measurement series, consisting of a number of events.
+ * The measurements can then be logged to the console.
+ * @tparam NAME_TYPE The type of the name of the event. Events are named using the NAME_TYPE type.
+ * It can be one of int, std::string, const char*. Other types should work as well, but are not tested.
+ * @tparam CLOCK The clock to read the time from, e.g. SteadyClock or TscClock.
+ * @tparam STORAGE Where the events are kept, e.g. VectorStorage, SegmentedStorage<>, RingStorage<4096>, PmrStorage or
+ * MappedFileStorage.
+*/
+template<class NAME_TYPE = int, class CLOCK = TIMER_DEFAULT_CLOCK, class STORAGE = VectorStorage>
+struct Timer : protected DebugStateTracker {
+	using TIME_STAMP_TYPE = TimeStamp<NAME_TYPE, CLOCK>;
+	using CONTAINER_TYPE  = typename STORAGE::template Container<TIME_STAMP_TYPE>;
+
+	std::pmr::memory_resource *memory_resource = std::pmr::get_default_resource(); // see PmrStorage
+	const std::string          file_name{};                                       // see MappedFileStorage
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+	/*
+	 * Holds the merged events of all threads, it is only updated by merge_thread_buffers().
+	 */
+	mutable std::vector<TIME_STAMP_TYPE> time_stamps{};
+	mutable uint64_t                     merged_dropped_events = 0;
+	mutable uint64_t                     merged_added_events   = 0; // added_events() at the last merge
+
+	/*
+	 * The thread buffers share the memory resource, which needn't be thread safe (e.g. monotonic_buffer_resource),
+	 * so growing them takes the lock.
+	 */
+	static constexpr bool shares_memory_resource = std::is_constructible_v<CONTAINER_TYPE, std::pmr::memory_resource *>;
+#else
+	CONTAINER_TYPE time_stamps = make_container<CONTAINER_TYPE>(memory_resource, file_name);
+	bool           reserved    = false; // see reserve(), checked with TIMER_DEBUG
+#endif
+
+	// IDs for automatic naming
+#ifdef TIMER_THREADS
+	std::atomic<int> id = 0;
+#else
+	int id = 0;
+#endif
+
+#ifdef TIMER_THREADS
+	std::mutex multithreading_guard{};
+#endif
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+	/*
+	 * Aligned to a cache line, so threads appending to their buffers never write to the same line.
+	 */
+	struct alignas(64) ThreadBuffer {
+		const uint16_t thread_index;
+		CONTAINER_TYPE time_stamps;
+		bool           reserved = false; // see reserve(), checked with TIMER_DEBUG
+
+		ThreadBuffer(uint16_t thread_index, std::pmr::memory_resource *resource, const std::string &file_name)
+			: thread_index(thread_index), time_stamps(make_container<CONTAINER_TYPE>(resource, file_name)) {}
+	};
+
+	std::vector<std::unique_ptr<ThreadBuffer>> thread_buffers{}; // indexed by thread name
+	uint64_t                                   instance = next_timer_instance();
+#endif
+#ifdef TIMER_THREADS
+	/*
+	 * Maps get_thread_index() to the name of the thread within this timer, -1 if it never added an event.
+	 */
+	std::vector<int> thread_names{};
+	int              thread_count = 0;
+#endif
+	std::vector<std::unique_ptr<LoopSection<NAME_TYPE, CLOCK>>> loops{}; // see loop()
+
+	static constexpr std::size_t dump_batch = 4096; // events copied per lock in dump()
+
+	Timer() = default;
+
+	/**
+	 * Allocates the events from the given memory resource, if the storage supports it, see PmrStorage.
+	 */
+	explicit Timer(std::pmr::memory_resource *resource) : memory_resource(resource) {}
+
+	/**
+	 * Writes the events to the given file, if the storage supports it, see MappedFileStorage.
+	 */
+	explicit Timer(std::string file_name) : file_name(std::move(file_name)) {}
+
+	/**
+	 * @brief Resets the timer.
+	 *
+	 * After calling this function, the timer can be initialized used again. Calling initialize on a timer automatically resets it.
+	 * Therefor there is no need to call this function before calling initialize.
+	 */
+	void reset() {
+		debug_reset();
+		time_stamps.clear();
+		id = 0;
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		thread_buffers.clear();
+		merged_dropped_events = 0;
+		merged_added_events   = 0; // otherwise the same number of events after initialize() would skip the merge
+		instance              = next_timer_instance();
+#endif
+#ifdef TIMER_THREADS
+		thread_names.clear();
+		thread_count = 0;
+#endif
+		loops.clear();
+	}
+
+	/**
+	 * Initialize reference point from where the measurements start. Call only once, if you don't want to reset the timer.
+	 */
+	void initialize() {
+#ifdef TIMER_SUBTRACT_OVERHEAD
+		(void) event_overhead();
+		(void) TimerOverhead<CLOCK>::code_section();
+#endif
+		initialize_uncalibrated();
+	}
+
+	/*
+	 * initialize() without measuring the overhead, for the scratch timer of event_overhead().
+	 */
+	void initialize_uncalibrated() {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		if (!thread_buffers.empty()) { reset(); }
+#else
+		if (!time_stamps.empty()) { reset(); }
+#endif
+		debug_init();
+		CLOCK::calibrate();
+		add();
+	}
+
+	/**
+	 * Cost included in every interval between two events of this Timer type, measured with back to back add() calls
+	 * of a scratch timer with the same name type, clock, storage and threading mode.
+	 */
+	static const OverheadEstimate &event_overhead() {
+		static const OverheadEstimate result = [] {
+			Timer timer;
+			timer.initialize_uncalibrated();
+			for (int i = 0; i < TimerOverhead<CLOCK>::samples; i++) { timer.add(NAME_TYPE{}); }
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+			timer.merge_thread_buffers();
+#endif
+			std::vector<int64_t> ticks;
+			ticks.reserve(TimerOverhead<CLOCK>::samples);
+			for (uint64_t i = 2; i < timer.time_stamps.size(); i++) {
+				ticks.push_back(timer.time_stamps[i].time_stamp - timer.time_stamps[i - 1].time_stamp);
+			}
+			return OverheadEstimate::from_samples(std::move(ticks));
+		}();
+		return result;
+	}
+
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+	/*
+	 * Looks up the buffer of the calling thread. A thread remembers the buffers of the last few timers it used,
+	 * only a miss takes the lock.
+	 */
+	ThreadBuffer &this_thread_buffer() {
+		struct CacheEntry {
+			uint64_t      instance = 0;
+			ThreadBuffer *buffer   = nullptr;
+		};
+		thread_local CacheEntry cache[4]{};
+		thread_local unsigned   next_victim = 0;
+
+		for (auto &entry: cache) {
+			if (entry.instance == instance) { return *entry.buffer; }
+		}
+		auto &entry    = cache[next_victim++ % 4];
+		entry.buffer   = &register_thread_buffer();
+		entry.instance = instance;
+		return *entry.buffer;
+	}
+
+	/*
+	 * Threads are named in the order they create their buffers, so the name is the index into thread_buffers.
+	 */
+	ThreadBuffer &register_thread_buffer() {
+		std::lock_guard lock(multithreading_guard);
+		const uint16_t  thread_index = get_thread_index();
+		const auto      thread_name  = std::size_t(name_thread(thread_index));
+		if (thread_name == thread_buffers.size()) {
+			const std::string buffer_file =
+					file_name.empty() ? file_name : file_name + "." + std::to_string(thread_name);
+			thread_buffers.emplace_back(std::make_unique<ThreadBuffer>(thread_index, memory_resource, buffer_file));
+		}
+		return *thread_buffers[thread_name];
+	}
+
+	struct MergeCursor {
+		const CONTAINER_TYPE *events;
+		std::size_t           index;
+
+		[[nodiscard]] const TIME_STAMP_TYPE &get() const { return (*events)[index]; }
+
+		static bool later(const MergeCursor &a, const MergeCursor &b) {
+			return b.get().time_stamp < a.get().time_stamp;
+		}
+	};
+
+	/*
+	 * Starts a k-way merge of the per thread buffers, each buffer is sorted by time already. If a buffer overwrote
+	 * events, the merge starts at its oldest retained event, so no thread has gaps. Returns the number of dropped
+	 * events, including the ones skipped for that. Like log(), this must not run concurrently with add().
+	 */
+	uint64_t start_merge(std::vector<MergeCursor> &heap) const {
+		int64_t  start   = std::numeric_limits<int64_t>::min();
+		uint64_t dropped = 0;
+		for (auto &buffer: thread_buffers) {
+			const auto &events = buffer->time_stamps;
+			dropped += dropped_events(events);
+			if (overwrites_oldest_events<CONTAINER_TYPE> && dropped_events(events) != 0) {
+				start = std::max(start, events.front().time_stamp);
+			}
+		}
+		for (auto &buffer: thread_buffers) {
+			const auto &events = buffer->time_stamps;
+			std::size_t first  = 0;
+			while (first < events.size() && events[first].time_stamp < start) { first++; }
+			dropped += first;
+			if (first < events.size()) { heap.push_back({&events, first}); }
+		}
+		std::make_heap(heap.begin(), heap.end(), MergeCursor::later);
+		return dropped;
+	}
+
+	/*
+	 * The next event of the merge, or nullptr at the end. The event stays in its buffer, nothing is copied.
+	 */
+	static const TIME_STAMP_TYPE *next_merged(std::vector<MergeCursor> &heap) {
+		if (heap.empty()) { return nullptr; }
+		std::pop_heap(heap.begin(), heap.end(), MergeCursor::later);
+		MergeCursor           &cursor = heap.back();
+		const TIME_STAMP_TYPE *event  = &cursor.get();
+		if (++cursor.index == cursor.events->size()) {
+			heap.pop_back();
+		} else {
+			std::push_heap(heap.begin(), heap.end(), MergeCursor::later);
+		}
+		return event;
+	}
+
+	/*
+	 * Merges the per thread buffers into time_stamps, for the accessors which index the events.
+	 */
+	void merge_thread_buffers() const {
+		std::vector<MergeCursor> heap;
+		merged_added_events   = added_events();
+		merged_dropped_events = start_merge(heap);
+		std::size_t length    = 0;
+		for (auto &cursor: heap) { length += cursor.events->size() - cursor.index; }
+		time_stamps.clear();
+		time_stamps.reserve(length);
+		while (const TIME_STAMP_TYPE *event = next_merged(heap)) { time_stamps.push_back(*event); }
+	}
+
+	/*
+	 * Every add() grows this number, also once a buffer overwrites its oldest events.
+	 */
+	[[nodiscard]] uint64_t added_events() const {
+		uint64_t count = 0;
+		for (auto &buffer: thread_buffers) { count += buffer->time_stamps.size() + dropped_events(buffer->time_stamps); }
+		return count;
+	}
+
+	/*
+	 * Merges the buffers only if events were added since the last merge.
+	 */
+	void merge_if_changed() const {
+		if (added_events() != merged_added_events) { merge_thread_buffers(); }
+	}
+#endif
+
+#ifdef TIMER_THREADS
+	/*
+	 * Gives the thread the next name of this timer, if it has none yet.
+	 */
+	int name_thread(uint16_t thread_index) {
+		if (thread_index >= thread_names.size()) { thread_names.resize(std::size_t(thread_index) + 1, -1); }
+		if (thread_names[thread_index] < 0) { thread_names[thread_index] = thread_count++; }
+		return thread_names[thread_index];
+	}
+#endif
+
+	void add_thread_unsafe(NAME_TYPE name) {
+		debug_check_if_initialized();
+		debug_add_event();
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		ThreadBuffer &buffer = this_thread_buffer();
+		debug_check_no_allocation(buffer.reserved, will_allocate(buffer.time_stamps));
+		if (shares_memory_resource && will_allocate(buffer.time_stamps)) {
+			std::lock_guard lock(multithreading_guard);
+			buffer.time_stamps.emplace_back(name, buffer.thread_index);
+			return;
+		}
+		buffer.time_stamps.emplace_back(name, buffer.thread_index);
+#elif defined(TIMER_THREADS)
+		const uint16_t thread_index = get_thread_index();
+		name_thread(thread_index);
+		debug_check_no_allocation(reserved, will_allocate(time_stamps));
+		time_stamps.emplace_back(name, thread_index);
+#else
+		debug_check_no_allocation(reserved, will_allocate(time_stamps));
+		time_stamps.emplace_back(name);
+#endif
+	}
+
+	/**
+	 * @brief Allocates room for the given number of events, so add() doesn't allocate until they are used up.
+	 * Call it after initialize(). With TIMER_DEBUG every add() which still allocates is reported.
+	 * With TIMER_THREAD_LOCAL_BUFFERS it reserves the buffer of the calling thread, so every thread which adds
+	 * events calls it once. Otherwise the first add() of every thread may still allocate to register the thread.
+	 */
+	void reserve(std::size_t events) {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		ThreadBuffer &buffer = this_thread_buffer();
+		if constexpr (shares_memory_resource) {
+			std::lock_guard lock(multithreading_guard);
+			reserve_events(buffer.time_stamps, events);
+		} else {
+			reserve_events(buffer.time_stamps, events);
+		}
+		debug_reserve(buffer.reserved);
+#else
+#ifdef TIMER_THREADS
+		std::lock_guard lock(multithreading_guard);
+#endif
+		reserve_events(time_stamps, events);
+		debug_reserve(reserved);
+#endif
+	}
+
+	/**
+	 * Add a named event. Must be called after initialize.
+	 */
+	const Timer &add(NAME_TYPE name) {
+#if defined(TIMER_THREADS) && !defined(TIMER_THREAD_LOCAL_BUFFERS)
+		std::lock_guard lock(multithreading_guard);
+#endif
+		add_thread_unsafe(name);
+		return *this;
+	}
+
+#if __cplusplus >= 202002L
+	/**
+	 * Add an event named at compile time, e.g. timer.add<"parse">(). Requires C++20.
+	 * With Timer<EventName> only the id of the name is stored and nothing is looked up while adding, with
+	 * Timer<const char *> the name points to the template argument.
+	 */
+	template<FixedString NAME>
+	const Timer &add() {
+		static_assert(std::is_same_v<NAME_TYPE, EventName> || std::is_constructible_v<NAME_TYPE, const char *>,
+					  "add<\"name\">() needs a NAME_TYPE which can be built from a string, e.g. Timer<EventName>");
+		if constexpr (std::is_same_v<NAME_TYPE, EventName>) {
+			return add(static_event_name<NAME>());
+		} else if constexpr (std::is_constructible_v<NAME_TYPE, const char *>) {
+			return add(NAME_TYPE(NAME.text));
+		} else {
+			return *this;
+		}
+	}
+#endif
+
+	/*
+	 * The thread names of a set of events. dump() formats with a copy taken under the lock, since add() names new
+	 * threads.
+	 */
+	struct ThreadNames {
+#ifdef TIMER_THREADS
+		const std::vector<int> &names;
+		int                     count;
+#endif
+
+		[[nodiscard]] int operator()([[maybe_unused]] uint16_t thread_index) const {
+#ifdef TIMER_THREADS
+			return thread_index < names.size() ? names[thread_index] : -1;
+#else
+			return 0;
+#endif
+		}
+
+		[[nodiscard]] bool several() const {
+#ifdef TIMER_THREADS
+			return count > 1;
+#else
+			return false;
+#endif
+		}
+	};
+
+	[[nodiscard]] ThreadNames thread_name_map() const {
+#ifdef TIMER_THREADS
+		return {thread_names, thread_count};
+#else
+		return {};
+#endif
+	}
+
+	/*
+	 * Note this naming scheme for each thread is not at all guaranteed to be equal to other names.
+	 * We name all threads which ever called add() from 0 to n-1.
+	 */
+	[[nodiscard]] int get_thread_name(uint16_t thread_index) const { return thread_name_map()(thread_index); }
+
+	[[nodiscard]] bool has_threads() const { return thread_name_map().several(); }
+
+	static constexpr const char *integer_string_literal_helper(int i) {
+		const char *ints[] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+		if (i < 10) return ints[i];
+		return "";
+	}
+
+	/**
+	 * Add an unnamed event. Must be called after initialize.
+	 */
+	const Timer &add() {
+		if constexpr (std::is_convertible<int, NAME_TYPE>::value) {
+			add(id++);
+		} else if constexpr (std::is_same<NAME_TYPE, std::string>::value) {
+			add(std::to_string(id++));
+		} else if constexpr (std::is_same<NAME_TYPE, const char *>::value ||
+							 std::is_same<NAME_TYPE, EventName>::value) {
+			add(integer_string_literal_helper(id++));
+		} else {
+			add({});
+		}
+		return *this;
+	}
+
+	/**
+	 * @brief Starts timing the iterations of a loop, call next() on the result at the end of every iteration.
+	 * Calling it again with the same name continues the statistics of that loop. The loop section stays valid until
+	 * the timer is reset.
+	 */
+	LoopSection<NAME_TYPE, CLOCK> &loop(NAME_TYPE name) {
+#ifdef TIMER_THREADS
+		std::lock_guard lock(multithreading_guard);
+#endif
+		for (auto &existing: loops) {
+			if (existing->name == name) {
+				existing->restart();
+				return *existing;
+			}
+		}
+		return *loops.emplace_back(std::make_unique<LoopSection<NAME_TYPE, CLOCK>>(name));
+	}
+
+	/**
+	 * @return The number of events which are no longer retained, see RingStorage. log() updates it in thread local mode.
+	 */
+	[[nodiscard]] uint64_t get_dropped_events() const {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		merge_if_changed();
+		return merged_dropped_events;
+#else
+		return dropped_events(time_stamps);
+#endif
+	}
+
+	/**
+	 * The time from initialize() to the event with the given index, in the order of log().
+	 * With TIMER_THREAD_LOCAL_BUFFERS the buffers are merged first if events were added since the last merge,
+	 * so like log() it must not run concurrently with add().
+	 */
+	[[nodiscard]] int64_t get_time_since_init(uint64_t index) const {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		merge_if_changed();
+#endif
+		return time_since_init(index);
+	}
+
+	/**
+	 * The time from the previous event to the event with the given index, see get_time_since_init().
+	 */
+	[[nodiscard]] int64_t get_time_since_last(uint64_t index) const {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		merge_if_changed();
+#endif
+		return time_since_last(index);
+	}
+
+	/*
+	 * Converting an EventName locks the NameTable, so loops over many events copy the names once and look them up with
+	 * name_text(). For other name types there is nothing to copy.
+	 */
+	static auto name_snapshot() {
+		if constexpr (std::is_same_v<NAME_TYPE, EventName>) {
+			return NameTable::get().snapshot();
+		} else {
+			return nullptr;
+		}
+	}
+
+	template<class NAMES>
+	static decltype(auto) name_text(const NAME_TYPE &name, [[maybe_unused]] const NAMES &names) {
+		if constexpr (std::is_same_v<NAME_TYPE, EventName>) {
+			return names[name.id];
+		} else {
+			return (name);
+		}
+	}
+
+	/*
+	 * Removes the overhead of the given number of events from a duration in nanoseconds.
+	 */
+	static int64_t subtract_events(int64_t ns, [[maybe_unused]] uint64_t events) {
+#ifdef TIMER_SUBTRACT_OVERHEAD
+		return std::max(int64_t(0), ns - CLOCK::to_ns(event_overhead().median) * int64_t(events));
+#else
+		return ns;
+#endif
+	}
+
+	/*
+	 * The same without merging, for loops over time_stamps which are merged already.
+	 */
+	[[nodiscard]] int64_t time_since_init(uint64_t index) const {
+		return subtract_events(TIME_STAMP_TYPE::get_diff(time_stamps[0], time_stamps[index]), index);
+	}
+
+	[[nodiscard]] int64_t time_since_last(uint64_t index) const {
+		return subtract_events(TIME_STAMP_TYPE::get_diff(time_stamps[index - 1], time_stamps[index]), 1);
+	}
+
+	template<std::size_t CAPACITY>
+	static void append_thread([[maybe_unused]] OutputBuffer<CAPACITY> &output,
+							  [[maybe_unused]] const TIME_STAMP_TYPE  &time_stamp,
+							  [[maybe_unused]] const ThreadNames      &threads) {
+		if (!threads.several()) { return; }
+#ifdef TIMER_THREADS
+		output.append(" in thread : ");
+		output.append_integer(threads(time_stamp.thread_index));
+#endif
+	}
+
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+	/*
+	 * Returns the previous event of the same thread, nullptr for its first event, and remembers this one.
+	 */
+	static const TIME_STAMP_TYPE *swap_previous_in_thread(std::vector<const TIME_STAMP_TYPE *> &previous_in_thread,
+														  const TIME_STAMP_TYPE                &time_stamp,
+														  [[maybe_unused]] const ThreadNames   &threads) {
+#ifdef TIMER_THREADS
+		const auto thread = std::size_t(threads(time_stamp.thread_index));
+#else
+		const std::size_t thread = 0;
+#endif
+		if (thread >= previous_in_thread.size()) { previous_in_thread.resize(thread + 1, nullptr); }
+		return std::exchange(previous_in_thread[thread], &time_stamp);
+	}
+#endif
+
+	/*
+	 * The previous event of the thread, nullptr if it was added by an exited thread which had the same index.
+	 */
+	static const TIME_STAMP_TYPE *same_thread([[maybe_unused]] const TIME_STAMP_TYPE *previous_in_thread,
+											  [[maybe_unused]] const TIME_STAMP_TYPE &current) {
+#if defined(TIMER_THREADS) && (defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME))
+		if (previous_in_thread != nullptr && previous_in_thread->thread_generation != current.thread_generation) {
+			return nullptr;
+		}
+#endif
+		return previous_in_thread;
+	}
+
+	/*
+	 * CPU time and performance counters are per thread, so they are relative to the previous event of the same thread.
+	 */
+	template<std::size_t CAPACITY>
+	void append_thread_measurements([[maybe_unused]] OutputBuffer<CAPACITY> &output,
+									[[maybe_unused]] const TIME_STAMP_TYPE   *previous_in_thread,
+									[[maybe_unused]] const TIME_STAMP_TYPE   &current) const {
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+		previous_in_thread = same_thread(previous_in_thread, current);
+		if (previous_in_thread == nullptr) { return; }
+#endif
+#ifdef TIMER_CPU_TIME
+		output.append_cpu_time(TIME_STAMP_TYPE::get_diff(*previous_in_thread, current),
+							   current.cpu_time - previous_in_thread->cpu_time);
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		PerfCounters::append(output, PerfCounters::difference(previous_in_thread->counters, current.counters));
+#endif
+	}
+
+	/*
+	 * The line printed by print_current(), formatted by the background thread with TIMER_ASYNC_OUTPUT.
+	 */
+	struct EventReport {
+		static constexpr bool format_later = !std::is_pointer_v<NAME_TYPE>; // a const char * name may be freed
+
+		NAME_TYPE name;
+		int64_t   time_since_last;
+		int64_t   time_since_init;
+		int       thread; // -1 if the timer was only used by one thread
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+		bool has_previous_in_thread;
+#endif
+#ifdef TIMER_CPU_TIME
+		int64_t wall_time_in_thread;
+		int64_t cpu_time;
+#endif
+#ifdef TIMER_PERF_COUNTERS
+		PerfCounters::Values counters;
+#endif
+
+		template<std::size_t CAPACITY>
+		void append(OutputBuffer<CAPACITY> &output) const {
+			output.append("Timer : ");
+			output.append_name(name);
+			output.append(" after ");
+			output.append_duration(time_since_last);
+			output.append(" at ");
+			output.append_duration(time_since_init);
+			if (thread >= 0) {
+				output.append(" in thread : ");
+				output.append_integer(thread);
+			}
+#ifdef TIMER_CPU_TIME
+			if (has_previous_in_thread) { output.append_cpu_time(wall_time_in_thread, cpu_time); }
+#endif
+#ifdef TIMER_PERF_COUNTERS
+			if (has_previous_in_thread) { PerfCounters::append(output, counters); }
+#endif
+			output.append('\n');
+		}
+	};
+
+	void print_event(const TIME_STAMP_TYPE &current, int64_t time_since_last, int64_t time_since_init,
+					 [[maybe_unused]] const TIME_STAMP_TYPE *previous_in_thread) const {
+		EventReport report{};
+		report.name            = current.name;
+		report.time_since_last = time_since_last;
+		report.time_since_init = time_since_init;
+		report.thread          = -1;
+#ifdef TIMER_THREADS
+		if (has_threads()) { report.thread = get_thread_name(current.thread_index); }
+#endif
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+		previous_in_thread            = same_thread(previous_in_thread, current);
+		report.has_previous_in_thread = previous_in_thread != nullptr;
+		if (previous_in_thread != nullptr) {
+#ifdef TIMER_CPU_TIME
+			report.wall_time_in_thread = TIME_STAMP_TYPE::get_diff(*previous_in_thread, current);
+			report.cpu_time            = current.cpu_time - previous_in_thread->cpu_time;
+#endif
+#ifdef TIMER_PERF_COUNTERS
+			report.counters = PerfCounters::difference(previous_in_thread->counters, current.counters);
+#endif
+		}
+#endif
+#ifdef TIMER_ASYNC_OUTPUT
+		AsyncOutput::push(report);
+#else
+		OutputBuffer<256> output(*output_sink().load(std::memory_order_acquire));
+		report.append(output);
+#endif
+	}
+
+	/**
+	 * Print information about the last measurement.
+	 */
+	void print_current() const {
+		debug_check_if_loggable();
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		/*
+		 * The last two events of the merged series are among the last two events of each buffer,
+		 * so there is no need for a full merge here.
+		 */
+		const TIME_STAMP_TYPE *first    = nullptr;
+		const TIME_STAMP_TYPE *previous = nullptr;
+		const TIME_STAMP_TYPE *current  = nullptr;
+		const auto             consider = [&](const TIME_STAMP_TYPE &time_stamp) {
+			if (current == nullptr || current->time_stamp < time_stamp.time_stamp) {
+				previous = current;
+				current  = &time_stamp;
+			} else if (previous == nullptr || previous->time_stamp < time_stamp.time_stamp) {
+				previous = &time_stamp;
+			}
+		};
+		uint64_t event_count = 0;
+		for (auto &buffer: thread_buffers) {
+			const auto &events = buffer->time_stamps;
+			if (events.empty()) { continue; }
+			if (first == nullptr || events.front().time_stamp < first->time_stamp) { first = &events.front(); }
+			if (events.size() > 1) { consider(events[events.size() - 2]); }
+			consider(events.back());
+			event_count += events.size();
+		}
+		const TIME_STAMP_TYPE *previous_in_thread = nullptr;
+		for (auto &buffer: thread_buffers) {
+			const auto &events = buffer->time_stamps;
+			if (events.size() > 1 && &events.back() == current) { previous_in_thread = &events[events.size() - 2]; }
+		}
+		print_event(*current, subtract_events(TIME_STAMP_TYPE::get_diff(*previous, *current), 1),
+					subtract_events(TIME_STAMP_TYPE::get_diff(*first, *current), event_count - 1), previous_in_thread);
+#else
+		const uint64_t         index              = time_stamps.size() - 1;
+		const TIME_STAMP_TYPE *previous_in_thread = nullptr;
+#if defined(TIMER_THREADS) && (defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME))
+		for (uint64_t i = index; i-- > 0 && previous_in_thread == nullptr;) {
+			if (time_stamps[i].thread_index == time_stamps[index].thread_index) {
+				previous_in_thread = &time_stamps[i];
+			}
+		}
+#else
+		previous_in_thread = &time_stamps[index - 1];
+#endif
+		print_event(time_stamps[index], time_since_last(index), time_since_init(index), previous_in_thread);
+#endif
+	}
+
+	/**
+	 * Histograms of the time since the previous event, one per event name. A LatencyHistogram<> has 1920 atomic
+	 * buckets, about 15 KB, so this allocates 15 KB per distinct name (and an aggregated code section 15 KB per call
+	 * site). Fine for tens of names, for thousands of distinct names use log() instead.
+	 */
+	[[nodiscard]] std::map<NAME_TYPE, LatencyHistogram<>> get_histograms() const {
+		std::map<NAME_TYPE, LatencyHistogram<>> histograms;
+		const TIME_STAMP_TYPE                  *previous = nullptr;
+		for_each_event([&](const TIME_STAMP_TYPE &time_stamp) {
+			if (previous != nullptr) {
+				const int64_t duration = subtract_events(TIME_STAMP_TYPE::get_diff(*previous, time_stamp), 1);
+				histograms[time_stamp.name].record(duration);
+			}
+			previous = &time_stamp;
+		});
+		return histograms;
+	}
+
+	/*
+	 * Calls function(const TIME_STAMP_TYPE &) for every event in time order, the events stay where they are until
+	 * the end. With TIMER_THREAD_LOCAL_BUFFERS the merge is streamed from the thread buffers like in log(), so the
+	 * events of e.g. MappedFileStorage never have to fit into memory.
+	 */
+	template<class FUNCTION>
+	void for_each_event(FUNCTION function) const {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		std::vector<MergeCursor> heap;
+		start_merge(heap);
+		while (const TIME_STAMP_TYPE *event = next_merged(heap)) { function(*event); }
+#else
+		for (uint64_t i = 0; i < time_stamps.size(); i++) { function(time_stamps[i]); }
+#endif
+	}
+
+	/**
+	 * Log the latency distribution of every event name.
+	 */
+	void log_histograms() const {
+		print_to_output_sink([&](std::ostream &output) {
+			output << "Timer histograms :\n";
+			for (auto &[name, histogram]: get_histograms()) {
+				output << "\t" << name << " : " << histogram.count << " times, ";
+				histogram.print(output);
+				output << "\n";
+			}
+		});
+	}
+
+	/**
+	 * Writes all events to a Chrome trace. Every event becomes a slice starting at the previous event of its thread,
+	 * the first event of each thread is an instant event.
+	 */
+	void export_trace(TraceEventWriter &writer) const {
+		const auto                           names = name_snapshot();
+		std::vector<const TIME_STAMP_TYPE *> previous_in_thread;
+		for_each_event([&](const TIME_STAMP_TYPE &time_stamp) {
+#ifdef TIMER_THREADS
+			const int thread = get_thread_name(time_stamp.thread_index);
+#else
+			const int thread = 0;
+#endif
+			if (std::size_t(thread) >= previous_in_thread.size()) {
+				previous_in_thread.resize(std::size_t(thread) + 1, nullptr);
+			}
+
+			const TIME_STAMP_TYPE *&previous = previous_in_thread[std::size_t(thread)];
+			const auto             &name     = name_text(time_stamp.name, names);
+			if (previous == nullptr) {
+				writer.thread_name(TraceEventWriter::timer_process, thread, "Thread " + std::to_string(thread));
+				writer.instant_event(name, "timer", TraceEventWriter::timer_process, thread,
+									 CLOCK::to_steady_ns(time_stamp.time_stamp));
+			} else {
+				writer.complete_event(name, "timer", TraceEventWriter::timer_process, thread,
+									  CLOCK::to_steady_ns(previous->time_stamp),
+									  TIME_STAMP_TYPE::get_diff(*previous, time_stamp));
+			}
+			previous = &time_stamp;
+		});
+	}
+
+	/**
+	 * Writes all events to a binary trace, see BinaryTraceWriter. The last block is written as well, so the trace
+	 * is complete even while the writer stays open for more events.
+	 */
+	void export_binary_trace(BinaryTraceWriter<CLOCK> &writer) const {
+		for_each_event([&](const TIME_STAMP_TYPE &time_stamp) {
+#ifdef TIMER_THREADS
+			const auto thread = uint32_t(get_thread_name(time_stamp.thread_index));
+#else
+			const uint32_t thread = 0;
+#endif
+			writer.event(time_stamp.name, thread, time_stamp.time_stamp);
+		});
+		writer.flush();
+	}
+
+	/**
+	 * Log all measurements
+	 */
+	void log() const {
+#ifdef TIMER_ASYNC_OUTPUT
+		MemorySink text;
+		log(text);
+		AsyncOutput::write(std::move(text.text));
+#else
+		log(*output_sink().load(std::memory_order_acquire));
+#endif
+	}
+
+	/**
+	 * Log all measurements to the given sink, on the calling thread.
+	 */
+	void log(Sink &sink) const {
+		const auto output = std::make_unique<OutputBuffer<>>(sink);
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		/*
+		 * The merge is streamed from the thread buffers, so their events are not copied, e.g. out of a mapped file.
+		 */
+		std::vector<MergeCursor> heap;
+		const uint64_t           dropped = start_merge(heap);
+		append_events(*output, dropped, thread_name_map(), [&] { return next_merged(heap); });
+#else
+		uint64_t index = 0;
+		append_events(*output, dropped_events(time_stamps), thread_name_map(), [&]() -> const TIME_STAMP_TYPE * {
+			return index == time_stamps.size() ? nullptr : &time_stamps[index++];
+		});
+#endif
+		for (auto &loop_section: loops) {
+			loop_section->append(*output);
+			output->append('\n');
+		}
+	}
+
+	/*
+	 * Formats the events next() returns until it returns nullptr, the first event is the reference point.
+	 */
+	template<class NEXT>
+	void append_events(OutputBuffer<> &output, uint64_t dropped, const ThreadNames &threads, NEXT next) const {
+		const auto names = name_snapshot();
+		output.append("Timer :\n");
+		if (dropped != 0) {
+			output.append("\t(");
+			output.append_integer(int64_t(dropped));
+			output.append(overwrites_oldest_events<CONTAINER_TYPE> ? " older events overwritten)\n"
+																	: " events dropped, the storage is full)\n");
+		}
+		const TIME_STAMP_TYPE *first    = next();
+		const TIME_STAMP_TYPE *previous = first;
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+		std::vector<const TIME_STAMP_TYPE *> previous_in_thread;
+		if (first != nullptr) { swap_previous_in_thread(previous_in_thread, *first, threads); }
+#endif
+		for (uint64_t i = 1; const TIME_STAMP_TYPE *event = first != nullptr ? next() : nullptr; i++) {
+			output.append('\t');
+			output.append_name(name_text(event->name, names));
+			output.append(" after ");
+			output.append_duration(subtract_events(TIME_STAMP_TYPE::get_diff(*previous, *event), 1));
+			output.append(" at ");
+			output.append_duration(subtract_events(TIME_STAMP_TYPE::get_diff(*first, *event), i));
+			append_thread(output, *event, threads);
+#if defined(TIMER_PERF_COUNTERS) || defined(TIMER_CPU_TIME)
+			append_thread_measurements(output, swap_previous_in_thread(previous_in_thread, *event, threads), *event);
+#endif
+			output.append('\n');
+			previous = event;
+		}
+	}
+
+	/**
+	 * Logs the events added so far while other threads keep adding events, see SignalDump. The events are copied in
+	 * batches of dump_batch events under the lock and formatted after releasing it, so adding waits for one batch at
+	 * most. Events added after the dump started are left out, with RingStorage the events overwritten meanwhile are
+	 * counted as dropped. The copy is kept in memory until the dump is written, also with MappedFileStorage.
+	 * Loop sections are updated without the lock and are not dumped. The buffers of TIMER_THREAD_LOCAL_BUFFERS can't
+	 * be read while their threads add events, so in that mode only a note is written.
+	 */
+	void dump(Sink &sink) {
+#ifdef TIMER_THREAD_LOCAL_BUFFERS
+		OutputBuffer<256> output(sink);
+		output.append("Timer : not dumped, TIMER_THREAD_LOCAL_BUFFERS timers can only be logged after adding\n");
+#else
+#ifdef TIMER_THREADS
+		const auto locked = [&](auto function) {
+			std::lock_guard lock(multithreading_guard);
+			function();
+		};
+#else
+		const auto locked = [](auto function) { function(); };
+#endif
+		/*
+		 * Positions count all events ever added, so they stay valid while a ring buffer overwrites its oldest events.
+		 */
+		const auto oldest_position = [&]() -> uint64_t {
+			return overwrites_oldest_events<CONTAINER_TYPE> ? dropped_events(time_stamps) : 0;
+		};
+		uint64_t dropped  = 0;
+		uint64_t position = 0;
+		uint64_t end      = 0;
+		locked([&] {
+			dropped  = dropped_events(time_stamps);
+			position = oldest_position();
+			end      = position + time_stamps.size();
+		});
+
+		std::vector<TIME_STAMP_TYPE> events;
+		events.reserve(std::size_t(end - position));
+		while (position < end) {
+			locked([&] {
+				const uint64_t oldest = oldest_position();
+				if (position < oldest) {
+					dropped += oldest - position;
+					position = oldest;
+				}
+				for (std::size_t copied = 0; position < end && copied < dump_batch; position++, copied++) {
+					events.push_back(time_stamps[std::size_t(position - oldest)]);
+				}
+			});
+		}
+
+#ifdef TIMER_THREADS
+		std::vector<int> names;
+		int              count = 0;
+		locked([&] {
+			names = thread_names;
+			count = thread_count;
+		});
+		const ThreadNames threads{names, count};
+#else
+		const ThreadNames threads{};
+#endif
+		if (events.empty()) { return; }
+		const auto  output = std::make_unique<OutputBuffer<>>(sink);
+		std::size_t index  = 0;
+		append_events(*output, dropped, threads, [&]() -> const TIME_STAMP_TYPE * {
+			return index == events.size() ? nullptr : &events[index++];
+		});
+#endif
+	}
+};
+
+template<class CLOCK>
+const OverheadEstimate &TimerOverhead<CLOCK>::timer_event() {
+	return Timer<int, CLOCK>::event_overhead();
+}
+
+#if defined(TIMER_THREADS) && (defined(__unix__) || defined(__APPLE__))
+#include <csignal>
+
+/**
+ * Writes the state of running timers and the aggregated code sections to a file whenever the process receives a
+ * signal, e.g. "kill -USR1 <pid>", so a long running process can be inspected without restarting it (POSIX only).
+ *
+ *	SignalDump::get().install("timer_dump.txt");   // SIGUSR1 by default
+ *	SignalDump::get().add(timer);                  // remove(timer) before the timer is destroyed
+ *
+ * The file is opened by install(), the handler only writes a byte to a pipe, which is async-signal-safe. A thread
+ * started by install() waits on the pipe and formats the dumps, appending them to the file. See Timer::dump() for
+ * what is written while other threads are adding events.
+ */
+struct SignalDump {
+	using Dump = std::function<void(Sink &)>;
+
+	static inline std::atomic<int> wake_fd{-1}; // the write end of the pipe, the only state the handler touches
+	static_assert(std::atomic<int>::is_always_lock_free, "The signal handler can only use lock free atomics");
+
+	std::vector<std::pair<const void *, Dump>> timers{};
+	std::mutex                                 guard{};
+	CodeSectionRegistry                       &sections = CodeSectionRegistry::get(); // destroyed after the dump
+	std::unique_ptr<FileSink>                  file{};
+	int                                        pipe_fds[2]   = {-1, -1};
+	int                                        signal_number = 0;
+	struct sigaction                           previous{};
+	std::atomic<bool>                          stopping{false};
+	std::thread                                worker{};
+
+	static SignalDump &get() {
+		static SignalDump dump;
+		return dump;
+	}
+
+	SignalDump() = default;
+	SignalDump(const SignalDump &)     = delete;
+	void operator=(const SignalDump &) = delete;
+	~SignalDump() { uninstall(); }
+
+	/**
+	 * Opens the file and handles the signal from now on. Returns false and prints an error if that fails.
+	 */
+	bool install(const char *path, int dump_signal = SIGUSR1) {
+		uninstall();
+		file = std::make_unique<FileSink>(path);
+		if (!file->is_open()) {
+			file.reset();
+			return false;
+		}
+		if (pipe(pipe_fds) != 0) {
+			std::cerr << "SignalDump: can not create a pipe" << std::endl;
+			file.reset();
+			return false;
+		}
+		for (const int fd: pipe_fds) { fcntl(fd, F_SETFD, FD_CLOEXEC); }
+		fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK); // the handler must never block, a full pipe means a dump is pending
+		wake_fd.store(pipe_fds[1]);
+
+		struct sigaction action{};
+		action.sa_handler = &handle_signal;
+		action.sa_flags   = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		signal_number = dump_signal;
+		sigaction(signal_number, &action, &previous);
+
+		stopping.store(false);
+		worker = std::thread([this] { run(); });
+		return true;
+	}
+
+	/**
+	 * Restores the previous handler, stops the thread and closes the file. Called at exit.
+	 */
+	void uninstall() {
+		if (!worker.joinable()) { return; }
+		sigaction(signal_number, &previous, nullptr);
+		wake_fd.store(-1);
+		stopping.store(true);
+		const char byte = 0;
+		[[maybe_unused]] const auto written = ::write(pipe_fds[1], &byte, 1);
+		worker.join();
+		for (int &fd: pipe_fds) {
+			::close(fd);
+			fd = -1;
+		}
+		file.reset();
+	}
+
+	/**
+	 * Dumps the events of the timer with every signal, until it is removed.
+	 */
+	template<class TIMER>
+	void add(TIMER &timer) {
+		std::lock_guard lock(guard);
+		timers.emplace_back(&timer, [&timer](Sink &sink) { timer.dump(sink); });
+	}
+
+	template<class TIMER>
+	void remove(const TIMER &timer) {
+		std::lock_guard lock(guard);
+		timers.erase(std::remove_if(timers.begin(), timers.end(), [&](auto &entry) { return entry.first == &timer; }),
+					 timers.end());
+	}
+
+	/**
+	 * Writes a dump now, on the calling thread.
+	 */
+	void dump() {
+		std::lock_guard lock(guard);
+		if (file == nullptr) { return; }
+		{
+			OutputBuffer<256> output(*file);
+			output.append("Timer dump at ");
+			output.append_duration(get_time_ns());
+			output.append(" (steady clock) :\n");
+		}
+		for (auto &[timer, dump_timer]: timers) { dump_timer(*file); }
+		std::ostringstream text;
+		sections.print(text);
+		file->write(text.str());
+		file->flush();
+	}
+
+private:
+	static void handle_signal(int) {
+		const int  saved_errno = errno;
+		const char byte        = 1;
+		if (const int fd = wake_fd.load(std::memory_order_relaxed); fd >= 0) {
+			[[maybe_unused]] const auto written = ::write(fd, &byte, 1);
+		}
+		errno = saved_errno;
+	}
+
+	void run() {
+		char bytes[64];
+		while (true) {
+			const ssize_t received = read(pipe_fds[0], bytes, sizeof(bytes));
+			if (received < 0 && errno == EINTR) { continue; }
+			if (received <= 0 || stopping.load()) { return; }
+			dump();
+		}
+	}
+};
+#endif
+#endif
@@ -0,0 +1,97 @@
+#include "timer.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+/*
+ * Prints a binary trace written by BinaryTraceWriter (Timer::export_binary_trace), or an event log written by
+ * MappedFileStorage, in the format of Timer::log():
+ * the first event is the reference point, every other event is printed with the time since the previous event
+ * and since the reference point, and with its thread if the trace has more than one.
+ * Usage: ./trace_dump <trace> [--summary]
+ * With --summary only the number of events per name and the decoding speed are printed.
+ */
+
+template<class READER>
+void print_events(READER &trace) {
+	const auto output       = std::make_unique<OutputBuffer<>>(std::cout);
+	bool       empty        = true;
+	bool       has_threads  = false;
+	uint32_t   first_thread = 0;
+	trace.for_each([&](const typename READER::Event &event) {
+		if (empty) { first_thread = event.thread; }
+		has_threads |= event.thread != first_thread;
+		empty = false;
+	});
+
+	int64_t first    = 0;
+	int64_t previous = 0;
+	empty            = true;
+	output->append("Timer :\n");
+	trace.for_each([&](const typename READER::Event &event) {
+		if (empty) {
+			first    = event.ticks;
+			previous = event.ticks;
+			empty    = false;
+			return;
+		}
+		output->append('\t');
+		output->append(trace.names[event.name]);
+		output->append(" after ");
+		output->append_duration(trace.to_ns(event.ticks - previous));
+		output->append(" at ");
+		output->append_duration(trace.to_ns(event.ticks - first));
+		if (has_threads) {
+			output->append(" in thread : ");
+			output->append_integer(event.thread);
+		}
+		output->append('\n');
+		previous = event.ticks;
+	});
+}
+
+template<class READER>
+void print_summary(READER &trace) {
+	std::vector<uint64_t> counts;
+	const auto            count = [&](const typename READER::Event &event) {
+		if (event.name >= counts.size()) { counts.resize(event.name + 1, 0); }
+		counts[event.name]++;
+	};
+	const int64_t  start   = get_time_ns();
+	const uint64_t events  = trace.for_each(count);
+	const int64_t  elapsed = std::max<int64_t>(get_time_ns() - start, 1);
+
+	std::map<std::string, uint64_t> by_name;
+	for (std::size_t i = 0; i < counts.size(); i++) { by_name[trace.names[i]] += counts[i]; }
+	for (const auto &[name, times]: by_name) { std::cout << "\t" << name << " : " << times << " times\n"; }
+	std::cout << events << " events, " << trace.data.size() << " bytes ("
+			  << double(trace.data.size()) / double(std::max<uint64_t>(events, 1)) << " bytes per event), decoded at "
+			  << double(trace.data.size()) / double(elapsed) << " GB/s\n";
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <trace> [--summary]" << std::endl;
+		return 1;
+	}
+	const bool summary = argc > 2 && std::strcmp(argv[2], "--summary") == 0;
+	const auto dump    = [&](auto &&trace) {
+		if (!trace.is_open()) { return 1; }
+		if (summary) {
+			print_summary(trace);
+		} else {
+			print_events(trace);
+		}
+		return 0;
+	};
+
+	uint64_t      magic = 0;
+	std::ifstream file(argv[1], std::ios::binary);
+	file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+	if (magic == MappedFileHeader::magic_value) { return dump(MappedFileReader(argv[1])); }
+	return dump(BinaryTraceReader(argv[1]));
+}